@@ -0,0 +1,247 @@
+/**
+ * @file buffer.h
+ * @brief Size-classed storage for packets held in queues
+ */
+
+#pragma once
+
+#include "packet.h"
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+/**
+ * Block sizes a PacketPool hands out: header-only packets such as acks,
+ * MTU-sized data, and the largest DataPacket
+ */
+enum class SizeClass : byte_t
+{
+    Small   = 0,
+    Mtu     = 1,
+    Jumbo   = 2,
+};
+
+inline constexpr std::array<size_t, 3> size_class_bytes {
+    64, 1536, sizeof (DataPacket)};
+
+/**
+ * Smallest class holding len bytes
+ */
+inline SizeClass size_class_of (size_t len)
+{
+    if (len <= size_class_bytes[0])
+        return SizeClass::Small;
+    if (len <= size_class_bytes[1])
+        return SizeClass::Mtu;
+
+    return SizeClass::Jumbo;
+}
+
+class PacketPool;
+
+/**
+ * One packet's wire bytes, exactly as long as received, in a block
+ * borrowed from a PacketPool. Move-only; gives the block back when
+ * destroyed. The pool must outlive it.
+ */
+class PacketRef
+{
+private:
+    PacketPool* pool = nullptr;
+    byte_t* block = nullptr;
+    uint32_t len = 0;
+    SizeClass size_class = SizeClass::Small;
+
+    friend class PacketPool;
+
+    PacketRef (PacketPool* pool, byte_t* block, uint32_t len,
+               SizeClass size_class)
+        : pool (pool), block (block), len (len), size_class (size_class) {}
+
+public:
+    PacketRef () = default;
+    ~PacketRef () { reset (); }
+
+    PacketRef (PacketRef&& other) noexcept { *this = std::move (other); }
+
+    PacketRef& operator = (PacketRef&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset ();
+            std::swap (pool, other.pool);
+            std::swap (block, other.block);
+            std::swap (len, other.len);
+            std::swap (size_class, other.size_class);
+        }
+
+        return *this;
+    }
+
+    PacketRef (const PacketRef&) = delete;
+    PacketRef& operator = (const PacketRef&) = delete;
+
+    /**
+     * Give the block back early
+     */
+    inline void reset ();
+
+    explicit operator bool () const { return block != nullptr; }
+
+    std::span<const byte_t> bytes () const { return {block, len}; }
+    size_t size () const { return len; }
+
+    PacketHeader header () const
+    {
+        PacketHeader header;
+        memcpy (&header, block, sizeof (header));
+        return header;
+    }
+
+    /**
+     * Whole ack, valid for PacketType::Ack
+     */
+    AckPacket ack () const
+    {
+        AckPacket ack {};
+        memcpy (&ack, block, std::min<size_t> (len, sizeof (ack)));
+        return ack;
+    }
+
+    /**
+     * Data payload, exactly as many bytes as arrived
+     */
+    std::span<const byte_t> payload () const
+    {
+        constexpr size_t offset = offsetof (DataPacket, payload);
+        if (len <= offset)
+            return {};
+
+        return {block + offset, len - offset};
+    }
+};
+
+/**
+ * Free lists of fixed-size blocks, one per SizeClass, carved from slabs
+ * allocated on demand and kept for reuse. Single-threaded.
+ */
+class PacketPool
+{
+private:
+    static constexpr size_t slab_blocks = 64;
+
+    struct ClassList
+    {
+        std::vector<byte_t*> free;
+        std::vector<std::unique_ptr<byte_t[]>> slabs;
+    };
+
+    std::array<ClassList, 3> classes {};
+
+    byte_t* take (SizeClass size_class)
+    {
+        ClassList& list = classes[(size_t) size_class];
+        if (list.free.empty ())
+        {
+            size_t block_bytes = size_class_bytes[(size_t) size_class];
+            list.slabs.push_back (
+                std::make_unique<byte_t[]> (block_bytes * slab_blocks));
+
+            byte_t* slab = list.slabs.back ().get ();
+            for (size_t ind = slab_blocks; ind > 0; --ind)
+                list.free.push_back (slab + (ind - 1) * block_bytes);
+        }
+
+        byte_t* block = list.free.back ();
+        list.free.pop_back ();
+        return block;
+    }
+
+public:
+    PacketPool () = default;
+    PacketPool (const PacketPool&) = delete;
+    PacketPool& operator = (const PacketPool&) = delete;
+
+    /**
+     * Copy a packet's wire bytes into the smallest block that fits.
+     * Longer than a DataPacket is truncated.
+     */
+    PacketRef store (std::span<const byte_t> bytes)
+    {
+        size_t len = std::min (bytes.size (), sizeof (DataPacket));
+        SizeClass size_class = size_class_of (len);
+        byte_t* block = take (size_class);
+        memcpy (block, bytes.data (), len);
+
+        return PacketRef (this, block, (uint32_t) len, size_class);
+    }
+
+    /**
+     * Store a data packet's header and used payload only
+     */
+    PacketRef store (const DataPacket& packet)
+    {
+        size_t len = offsetof (DataPacket, payload)
+                   + std::min (packet.byte_count, MAX_PAYLOAD_BYTE_COUNT);
+        return store ({(const byte_t*) &packet, len});
+    }
+
+    /**
+     * Store a data packet from its header and a payload held elsewhere,
+     * filling the block directly rather than through a DataPacket
+     */
+    PacketRef store (const PacketHeader& header,
+                     std::span<const byte_t> payload)
+    {
+        constexpr size_t offset = offsetof (DataPacket, payload);
+        size_t byte_count = std::min (payload.size (), MAX_PAYLOAD_BYTE_COUNT);
+        size_t len = offset + byte_count;
+        SizeClass size_class = size_class_of (len);
+        byte_t* block = take (size_class);
+
+        memcpy (block, &header, sizeof (header));
+        memcpy (block + offsetof (DataPacket, byte_count), &byte_count,
+                sizeof (byte_count));
+        memcpy (block + offset, payload.data (), byte_count);
+
+        return PacketRef (this, block, (uint32_t) len, size_class);
+    }
+
+    PacketRef store (const AckPacket& packet)
+    {
+        return store ({(const byte_t*) &packet, sizeof (packet)});
+    }
+
+    void give_back (SizeClass size_class, byte_t* block)
+    {
+        classes[(size_t) size_class].free.push_back (block);
+    }
+
+    /**
+     * Memory held in slabs, in use or free
+     */
+    size_t reserved_bytes () const
+    {
+        size_t total = 0;
+        for (size_t ind = 0; ind < classes.size (); ++ind)
+            total += classes[ind].slabs.size () * slab_blocks
+                   * size_class_bytes[ind];
+
+        return total;
+    }
+};
+
+inline void PacketRef::reset ()
+{
+    if (block != nullptr)
+        pool->give_back (size_class, block);
+
+    pool = nullptr;
+    block = nullptr;
+    len = 0;
+}
@@ -0,0 +1,373 @@
+/**
+ * @file capture.h
+ * @brief pcapng packet capture with synthesized IPv4/UDP headers
+ */
+
+#pragma once
+
+#include "types.h"
+#include "packet.h"
+#include "helpers.h"
+#include "ring.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <span>
+#include <thread>
+
+/**
+ * What happened to a captured packet, stored as a pcapng comment
+ */
+enum class CaptureEvent : byte_t
+{
+    Received    = 0,
+    Dropped     = 1,
+    Forwarded   = 2,
+};
+
+inline const char* capture_event_name (CaptureEvent event)
+{
+    switch (event)
+    {
+        case CaptureEvent::Received:    return "received";
+        case CaptureEvent::Dropped:     return "dropped";
+        case CaptureEvent::Forwarded:   return "forwarded";
+    }
+
+    return "unknown";
+}
+
+/**
+ * Writes packets to a pcapng file as raw IPv4 frames, one interface,
+ * nanosecond timestamps. Headers are synthesized from the endpoints,
+ * payloads are the packets' wire bytes cut to the snap length.
+ *
+ * Records are built in place in a lock-free ring and written by a
+ * background thread through a large stdio buffer, so capturing costs
+ * the forwarding loop one copy of the kept bytes. Records are dropped,
+ * and counted, if the writer falls a full ring behind. Inert if no path
+ * is given.
+ */
+class PacketCapture
+{
+private:
+    static constexpr size_t ring_capacity = 1 << 12;
+    static constexpr size_t frame_header_bytes = 20 + 8;    // IPv4 + UDP
+    static constexpr size_t write_buffer_bytes = 1 << 20;
+
+    // Largest wire payload, a full DataPacket
+    static constexpr size_t max_payload = sizeof (DataPacket);
+
+    static constexpr uint16_t linktype_ipv4 = 228;
+
+    /**
+     * One packet waiting for the writer
+     */
+    struct Record
+    {
+        ns_t time_ns;
+        sockaddr_in src;
+        sockaddr_in dst;
+        uint32_t wire_len;      // whole payload, maybe not all kept
+        CaptureEvent event;
+        byte_t ecn;             // IP ECN codepoint
+        std::array<byte_t, max_payload> payload;
+    };
+
+    FILE* file = nullptr;
+    std::unique_ptr<char[]> write_buffer;
+    std::unique_ptr<SpscRing<Record>> ring;
+    std::thread writer;
+    std::atomic<bool> running {false};
+    size_t snaplen;
+    size_t dropped = 0;
+
+    // Wall clock minus get_time_ns (), pcap timestamps are epoch based
+    ns_t epoch_offset_ns = 0;
+
+    /**** FILE FORMAT ****/
+
+    template <typename T>
+    void put (const T& value)
+    {
+        std::fwrite (&value, sizeof (value), 1, file);
+    }
+
+    void pad (size_t len)
+    {
+        static constexpr byte_t zeros[4] = {};
+        std::fwrite (zeros, 1, (4 - len % 4) % 4, file);
+    }
+
+    static size_t padded (size_t len) { return (len + 3) & ~size_t {3}; }
+
+    void write_preamble ()
+    {
+        // Section header: byte order magic, version 1.0, unknown length
+        put<uint32_t> (0x0A0D0D0A);
+        put<uint32_t> (28);
+        put<uint32_t> (0x1A2B3C4D);
+        put<uint16_t> (1);
+        put<uint16_t> (0);
+        put<int64_t> (-1);
+        put<uint32_t> (28);
+
+        // Interface: raw IPv4, if_tsresol of 10^-9
+        put<uint32_t> (1);
+        put<uint32_t> (32);
+        put<uint16_t> (linktype_ipv4);
+        put<uint16_t> (0);
+        put<uint32_t> ((uint32_t) snaplen);
+        put<uint16_t> (9);
+        put<uint16_t> (1);
+        put<uint32_t> (9);
+        put<uint32_t> (0);
+        put<uint32_t> (32);
+    }
+
+    static uint16_t ip_checksum (const byte_t* header, size_t len)
+    {
+        uint32_t sum = 0;
+        for (size_t ind = 0; ind + 1 < len; ind += 2)
+            sum += (header[ind] << 8) | header[ind + 1];
+        while (sum >> 16)
+            sum = (sum & 0xFFFF) + (sum >> 16);
+
+        return (uint16_t) ~sum;
+    }
+
+    /**
+     * Enhanced packet block: direction flag and the event as a comment
+     */
+    void write_record (const Record& record)
+    {
+        size_t frame_len = frame_header_bytes + record.wire_len;
+        size_t cap_len = std::min (frame_len, snaplen);
+        const char* comment = capture_event_name (record.event);
+        size_t comment_len = std::strlen (comment);
+
+        size_t block_len = 28 + padded (cap_len) + 8
+                         + 4 + padded (comment_len) + 4 + 4;
+
+        // IPv4 and UDP headers, network order, UDP checksum left out
+        byte_t frame[frame_header_bytes] = {};
+        uint16_t ip_len = htons ((uint16_t) frame_len);
+        uint16_t udp_len = htons ((uint16_t) (8 + record.wire_len));
+        frame[0] = 0x45;
+        frame[1] = record.ecn;
+        memcpy (frame + 2, &ip_len, 2);
+        frame[6] = 0x40;                // don't fragment
+        frame[8] = 64;
+        frame[9] = IPPROTO_UDP;
+        memcpy (frame + 12, &record.src.sin_addr, 4);
+        memcpy (frame + 16, &record.dst.sin_addr, 4);
+        uint16_t checksum = htons (ip_checksum (frame, 20));
+        memcpy (frame + 10, &checksum, 2);
+        memcpy (frame + 20, &record.src.sin_port, 2);
+        memcpy (frame + 22, &record.dst.sin_port, 2);
+        memcpy (frame + 24, &udp_len, 2);
+
+        uint64_t stamp = (uint64_t) (record.time_ns + epoch_offset_ns);
+        uint32_t direction = record.event == CaptureEvent::Forwarded
+                           ? 2 : 1;
+
+        put<uint32_t> (6);
+        put<uint32_t> ((uint32_t) block_len);
+        put<uint32_t> (0);
+        put<uint32_t> ((uint32_t) (stamp >> 32));
+        put<uint32_t> ((uint32_t) stamp);
+        put<uint32_t> ((uint32_t) cap_len);
+        put<uint32_t> ((uint32_t) frame_len);
+
+        size_t header_part = std::min (cap_len, frame_header_bytes);
+        std::fwrite (frame, 1, header_part, file);
+        std::fwrite (record.payload.data (), 1, cap_len - header_part, file);
+        pad (cap_len);
+
+        // epb_flags, opt_comment, opt_endofopt
+        put<uint16_t> (2);
+        put<uint16_t> (4);
+        put<uint32_t> (direction);
+        put<uint16_t> (1);
+        put<uint16_t> ((uint16_t) comment_len);
+        std::fwrite (comment, 1, comment_len, file);
+        pad (comment_len);
+        put<uint32_t> (0);
+        put<uint32_t> ((uint32_t) block_len);
+    }
+
+    /**
+     * Writer thread: drain ring to file until stopped
+     */
+    void drain ()
+    {
+        while (true)
+        {
+            bool stopping = !running.load (std::memory_order_acquire);
+
+            size_t written = 0;
+            std::span<Record> batch;
+            while (!(batch = ring->acquire_read ()).empty ())
+            {
+                for (const Record& record : batch)
+                    write_record (record);
+
+                ring->release_read (batch.size ());
+                written += batch.size ();
+            }
+
+            if (written > 0)
+                std::fflush (file);
+
+            if (stopping)
+                return;
+
+            if (written == 0)
+                std::this_thread::sleep_for (std::chrono::milliseconds (5));
+        }
+    }
+
+    /**
+     * Ring slot for a new record with its addressing filled in, nullptr
+     * if inert or full
+     */
+    Record* reserve (CaptureEvent event, ns_t time_ns,
+                     const sockaddr_in& src, const sockaddr_in& dst,
+                     byte_t flags)
+    {
+        if (!ring)
+            return nullptr;
+
+        Record* record = ring->try_reserve ();
+        if (record == nullptr)
+        {
+            ++dropped;
+            return nullptr;
+        }
+
+        record->event = event;
+        record->time_ns = time_ns;
+        record->src = src;
+        record->dst = dst;
+        record->ecn = (flags & (byte_t) PacketFlag::Ce) ? 0x3
+                    : (flags & (byte_t) PacketFlag::Ect) ? 0x2 : 0x0;
+        return record;
+    }
+
+public:
+    /**
+     * Capture to path, keeping at most snaplen bytes of each IPv4 frame
+     */
+    PacketCapture (const char* path, size_t snaplen = 65535)
+        : snaplen (std::clamp (snaplen, frame_header_bytes,
+                               frame_header_bytes + max_payload))
+    {
+        if (path == nullptr)
+            return;
+
+        file = std::fopen (path, "wb");
+        if (file == nullptr)
+        {
+            std::cerr << "Could not open capture file " << path << std::endl;
+            return;
+        }
+
+        write_buffer = std::make_unique<char[]> (write_buffer_bytes);
+        std::setvbuf (file, write_buffer.get (), _IOFBF, write_buffer_bytes);
+
+        timespec wall;
+        clock_gettime (CLOCK_REALTIME, &wall);
+        epoch_offset_ns = wall.tv_sec * 1000000000LL + wall.tv_nsec
+                        - get_time_ns ();
+
+        write_preamble ();
+
+        ring = std::make_unique<SpscRing<Record>> (ring_capacity);
+        running.store (true, std::memory_order_release);
+        writer = std::thread (&PacketCapture::drain, this);
+    }
+
+    ~PacketCapture ()
+    {
+        if (file == nullptr)
+            return;
+
+        running.store (false, std::memory_order_release);
+        writer.join ();
+        std::fclose (file);
+    }
+
+    PacketCapture (const PacketCapture&) = delete;
+    PacketCapture& operator = (const PacketCapture&) = delete;
+
+    bool is_open () const { return file != nullptr; }
+    size_t dropped_records () const { return dropped; }
+
+    /**
+     * Capture a data packet, encoded as it travels on the wire
+     */
+    void record_data (CaptureEvent event, ns_t time_ns,
+                      const sockaddr_in& src, const sockaddr_in& dst,
+                      const PacketHeader& header,
+                      std::span<const byte_t> payload)
+    {
+        Record* record = reserve (event, time_ns, src, dst, header.flags);
+        if (record == nullptr)
+            return;
+
+        // Same encoding as send_data_view ()
+        struct
+        {
+            PacketHeader header;
+            size_t byte_count;
+        } wire {.header = {.type = PacketType::Data,
+                           .flags = header.flags,
+                           .id = htonl (header.id),
+                           .send_ns = (ns_t) htobe64 (header.send_ns)},
+                .byte_count = htonl (payload.size ())};
+
+        // Only what the snap length keeps
+        size_t room = snaplen - frame_header_bytes;
+        size_t keep = room > sizeof (wire)
+                    ? std::min (payload.size (), room - sizeof (wire)) : 0;
+
+        memcpy (record->payload.data (), &wire, sizeof (wire));
+        memcpy (record->payload.data () + sizeof (wire), payload.data (),
+                keep);
+        record->wire_len = (uint32_t) (sizeof (wire) + payload.size ());
+        ring->commit_push ();
+    }
+
+    /**
+     * Capture an ack, encoded as it travels on the wire
+     */
+    void record_ack (CaptureEvent event, ns_t time_ns,
+                     const sockaddr_in& src, const sockaddr_in& dst,
+                     const AckPacket& ack)
+    {
+        Record* record = reserve (event, time_ns, src, dst,
+                                  ack.header.flags);
+        if (record == nullptr)
+            return;
+
+        // Same encoding as send_ack ()
+        AckPacket wire {.header = {.type = PacketType::Ack,
+                                   .flags = ack.header.flags,
+                                   .id = htonl (ack.header.id),
+                                   .send_ns = (ns_t) htobe64 (
+                                       ack.header.send_ns)},
+                        .cumulative = htonl (ack.cumulative),
+                        .window = htonl (ack.window)};
+
+        memcpy (record->payload.data (), &wire, sizeof (wire));
+        record->wire_len = sizeof (wire);
+        ring->commit_push ();
+    }
+};
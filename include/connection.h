@@ -0,0 +1,372 @@
+/**
+ * @file connection.h
+ * @brief Non-blocking reliable transport over UDP
+ */
+
+#pragma once
+
+#include "types.h"
+#include "packet.h"
+#include "metrics.h"
+#include "pacer.h"
+#include "perf.h"
+#include "trace.h"
+#include "window.h"
+#include "reorder.h"
+#include "link.h"
+#include <functional>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+#include <sys/types.h>
+
+/**
+ * Connection setup
+ */
+struct ConnectionConfig
+{
+    int bind_port;
+    int peer_port;
+    const char* peer_ip = "127.0.0.1";
+
+    // Bytes per data packet
+    size_t payload_size = 1024;
+
+    // Token bucket pacing, unshaped when rate is unset
+    std::optional<double> pacing_rate = std::nullopt;
+    double pacing_burst = 5;
+
+    // Unacked packets are resent after this long
+    ms_t retransmit_timeout = 100;
+
+    // Packets in flight before send () reports EAGAIN
+    size_t window_size = Window::default_size;
+
+    // Received packets held for reordering and for the application,
+    // advertised to the peer in every ack. Data past it is refused.
+    size_t receive_window = ReorderBuffer::default_capacity;
+
+    // Pack messages small enough to share a packet into one, sent once
+    // full or bundle_delay after its first message. 0 sends each message
+    // on its own.
+    us_t bundle_delay = 0;
+
+    // Ack every ack_every'th packet, or ack_delay after the first unacked
+    // one, whichever is sooner. Gaps, duplicates and the fin are acked at
+    // once. An ack_every of 1 acks each packet.
+    size_t ack_every = 2;
+    ms_t ack_delay = 10;
+
+    // Sequence number of the first packet each way, both ends must agree.
+    // Counted in 64 bits, the wire carries the low 32.
+    seq_t initial_sequence = 0;
+
+    // Send data ECN capable. An echoed congestion mark halves the
+    // congestion window, and the pacing rate with it, at most once per
+    // rtt; each window's worth of acks grows it back by one packet.
+    bool ecn = true;
+};
+
+/**
+ * One end of a reliable, ordered, paced byte stream between two ports.
+ *
+ * Nothing blocks: send () and recv () return -1 with errno EAGAIN when
+ * the window is full or nothing is ready, and the owner calls service ()
+ * whenever fd () polls readable, and at least every few milliseconds, to
+ * process acks and data and to retransmit.
+ *
+ * Either end may send and receive. The stream ends with finish (), after
+ * which the peer's recv () returns 0 once everything is delivered.
+ *
+ * Packets travel over UDP by default, or over any PacketLink given.
+ */
+class Connection
+{
+public:
+    using EventHandler = std::function<void (const TraceEvent&)>;
+
+    explicit Connection (const ConnectionConfig& config);
+    Connection (const ConnectionConfig& config,
+                std::unique_ptr<PacketLink> link);
+
+    Connection (const Connection&) = delete;
+    Connection& operator = (const Connection&) = delete;
+
+    bool is_open () const { return open; }
+
+    /**
+     * Descriptor to poll for POLLIN
+     */
+    int fd () const { return link->fd (); }
+
+    /**
+     * Drain the socket and send anything due. Never blocks.
+     */
+    void service ();
+
+    /**
+     * Queue up to payload_size bytes, copied. Returns bytes accepted,
+     * or -1 with EAGAIN when the window is full or a message is still
+     * being queued.
+     *
+     * With a lifetime, in ms, the packet is abandoned if still unacked
+     * that long after: it is no longer retransmitted and the peer is told
+     * to skip it. 0 keeps it reliable.
+     */
+    ssize_t send (std::span<const byte_t> data, ms_t lifetime = 0);
+
+    /**
+     * As send (), without copying. data must stay valid until acked or
+     * abandoned.
+     */
+    ssize_t send_ref (std::span<const byte_t> data, ms_t lifetime = 0);
+
+    /**
+     * Queue a message of any size below 4 GB, split into fragments that
+     * carry its id, their offset in it and, on the last, an end marker.
+     * Fragments are copied into the window as it opens, here and in
+     * later service ()s, so message must stay valid while
+     * sending_message (). Returns the message size, or -1 with EAGAIN
+     * while an earlier message is still being queued, or EINVAL for an
+     * empty message.
+     *
+     * A lifetime applies to the whole message, counted from this call.
+     *
+     * With a bundle_delay, small messages are copied into a shared
+     * packet instead and may be released at once.
+     */
+    ssize_t send_message (std::span<const byte_t> message, ms_t lifetime = 0);
+
+    /**
+     * A message is still being split into the window
+     */
+    bool sending_message () const { return outgoing.active; }
+
+    /**
+     * Small messages are waiting to share a packet, to be sent by
+     * next_timer_ns () if the window allows
+     */
+    bool bundle_pending () const { return bundle.count > 0; }
+
+    /**
+     * End the outgoing stream. Returns false (retry later) if the window
+     * is full.
+     */
+    bool finish ();
+
+    /**
+     * Copy the next in-order payload into buffer, truncating if short.
+     * Returns bytes copied, 0 at end of stream, or -1 with EAGAIN.
+     * Message fragments read as their data, so messages can be consumed
+     * as a byte stream too.
+     */
+    ssize_t recv (std::span<byte_t> buffer);
+
+    /**
+     * Length of the message recv_message () is on or would start next,
+     * known from its first fragment. -1 with EAGAIN until that arrives.
+     */
+    ssize_t message_size () const;
+
+    /**
+     * Reassemble the next message into destination, releasing each
+     * fragment once placed, so messages may exceed the receive window.
+     * Once a message has begun, fragments read from the socket after it
+     * go straight to their offset in destination, so destination must
+     * stay valid until the message is returned or dropped, and such
+     * fragments peek () as empty. Returns the message length once whole,
+     * 0 at end of stream, or -1 with errno EAGAIN while fragments are
+     * still to come (call again with the same destination) or EMSGSIZE
+     * if destination is shorter than message_size ().
+     *
+     * Data sent with send () reads as one message per packet. Messages
+     * missing fragments the sender abandoned are dropped.
+     */
+    ssize_t recv_message (std::span<byte_t> destination);
+
+    /**
+     * Time the next delayed ack, retransmit or bundle falls due, in
+     * get_time_ns () terms. service () must run by then.
+     */
+    ns_t next_timer_ns () const;
+
+    /**
+     * Zero-copy receive: the next in-order payload, or the one index
+     * places behind it, empty if none. Fragments give their data. Valid
+     * until consume () releases it, other payloads may be consumed
+     * meanwhile.
+     */
+    std::span<const byte_t> peek (size_t index = 0) const;
+
+    /**
+     * Delivered payloads waiting to be consumed
+     */
+    size_t ready_count () const { return reorder.ready_size (); }
+
+    /**
+     * Release the payload returned by peek ()
+     */
+    void consume ();
+
+    /**** BACKPRESSURE / STATE ****/
+    bool writable () const
+    {
+        return window.n < congestion_window () && peer_window_open ();
+    }
+
+    size_t window_size () const { return window.max_size (); }
+    size_t congestion_window () const { return (size_t) cwnd; }
+    bool flushed () const { return window.n == 0; }
+    size_t in_flight () const { return window.unacked (); }
+
+    bool peer_finished () const { return fin_received; }
+    bool peer_verified () const { return fin_verified; }
+    size_t delivered_bytes () const { return receive_bytes; }
+    ms_t last_receive_ms () const { return last_receive; }
+
+    const SenderMetrics& sender_metrics () const { return send_metrics; }
+    const ReceiverMetrics& receiver_metrics () const { return receive_metrics; }
+
+    /**
+     * Called for every packet event, e.g. to feed a Display or Tracer
+     */
+    void set_event_handler (EventHandler handler) { on_event = handler; }
+
+    /**
+     * Attribute send, receive and reorder work to profiler's sections,
+     * nullptr to stop. The profiler must outlive the connection.
+     */
+    void set_profiler (SectionProfiler* sections) { profiler = sections; }
+
+private:
+    ConnectionConfig config;
+    std::unique_ptr<PacketLink> link;
+    bool open = false;
+
+    // Send side
+    Window window;
+    std::optional<TokenBucket> pacer;
+    seq_t next_send_seq;
+    bool fin_queued = false;
+    size_t send_bytes = 0;
+    uint64_t send_checksum;
+    std::vector<std::array<byte_t, MAX_PAYLOAD_BYTE_COUNT>> send_storage;
+    std::array<byte_t, sizeof (FinPayload)> fin_payload {};
+    SenderMetrics send_metrics {};
+
+    // Message being split into fragments as the window opens
+    struct
+    {
+        bool active = false;
+        uint32_t message_id = 0;
+        std::span<const byte_t> data {};
+        size_t offset = 0;
+        ns_t expire_ns = 0;
+    } outgoing;
+
+    // Small messages waiting to share a packet, sent once full or at
+    // deadline_ns. Expires with its first message that has a lifetime,
+    // never if any has none.
+    struct
+    {
+        std::array<byte_t, MAX_PAYLOAD_BYTE_COUNT> bytes {};
+        std::array<bundle_field_t, MAX_PAYLOAD_BYTE_COUNT / 2> lengths {};
+        size_t used = 0;
+        size_t count = 0;
+        ns_t deadline_ns = 0;
+        ns_t expire_ns = 0;
+    } bundle;
+
+    // Congestion window in packets, at most the window size. Marks on
+    // packets sent before recover_seq belong to the last reduction.
+    double cwnd;
+    seq_t recover_seq;
+
+    // Sequence number the peer's advertised window ends before. Only
+    // grows, as the peer never takes back room it offered.
+    seq_t peer_edge;
+
+    // Partial reliability. Every packet before forward_seq is acked or
+    // abandoned; until the peer's cumulative ack reaches it, a forward
+    // notice telling the peer to skip there is repeated each timeout.
+    seq_t abandoned_end;        // one past the last packet abandoned
+    seq_t forward_seq;
+    seq_t peer_cumulative;
+    ns_t forward_sent_ns = 0;
+
+    // Receive side
+    ReorderBuffer reorder;
+    bool fin_received = false;
+    bool fin_verified = false;
+    uint64_t receive_checksum;
+    size_t receive_bytes = 0;
+    ms_t last_receive = 0;
+    ReceiverMetrics receive_metrics {};
+
+    // Message being reassembled. After a message is dropped its id is
+    // kept, and its remaining fragments discarded.
+    struct
+    {
+        bool active = false;
+        bool discarding = false;
+        uint32_t message_id = 0;
+        size_t length = 0;
+        size_t received = 0;
+        std::span<byte_t> destination {};
+
+        // Position in the bundle at the front, if any
+        size_t record = 0;
+        size_t record_offset = 0;
+    } incoming;
+
+    // Delayed ack: newest packet to echo, held until due
+    AckPacket pending_ack {};
+    size_t unacked_count = 0;
+    ns_t ack_deadline = 0;
+    bool ce_pending = false;
+    size_t advertised = 0;      // window in the last ack sent
+
+    EventHandler on_event;
+    SectionProfiler* profiler = nullptr;
+
+    /**
+     * Room in the peer's receive window. With it closed and nothing in
+     * flight, one packet may go as a probe; it is retransmitted until
+     * the peer has room and acks it with the window open again.
+     */
+    bool peer_window_open () const
+    {
+        return next_send_seq < peer_edge
+            || (next_send_seq == peer_edge && window.n == 0);
+    }
+
+    /**
+     * Full sequence number of a wire id near the send point
+     */
+    seq_t widen (id_t id) const
+    {
+        return next_send_seq + (seq_t) id_distance (id, (id_t) next_send_seq);
+    }
+
+    void event (Stage stage, EventType type, id_t id);
+    ssize_t enqueue (std::span<const byte_t> payload, byte_t flags,
+                     ns_t expire_ns);
+    void pump_message ();
+    bool bundle_fits (size_t size) const;
+    ssize_t bundle_message (std::span<const byte_t> message, ms_t lifetime);
+    bool flush_bundle ();
+    bool transmit (WindowSlot& slot);
+    void abandon_expired (ns_t now);
+    void send_forward (ns_t now);
+    void handle_ack (const AckPacket& ack, ns_t now);
+    void on_congestion (id_t id, size_t newly_acked, bool marked);
+    void receive_data (const DataPacket& packet, ns_t now);
+    uint32_t place_fragment (const DataPacket& packet);
+    void handle_data (PacketRef packet, uint32_t placed, ns_t now);
+    void handle_forward (const PacketHeader& header, ns_t now);
+    void flush_ack ();
+    bool on_contiguous (const BufferedPacket& buffered, ns_t now);
+    void drop_message ();
+    ssize_t recv_record (std::span<byte_t> destination);
+};
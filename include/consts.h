@@ -5,6 +5,8 @@
 
 #pragma once
 
-bool debug          = true;
+#include "types.h"
 
-ms_t ack_timeout    = 50;
\ No newline at end of file
+inline bool debug   = true;
+
+inline ms_t ack_timeout = 50;
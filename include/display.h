@@ -3,9 +3,13 @@
  * @brief Display class for clean telemetry
  */
 
+#pragma once
+
 #include "types.h"
+#include "trace.h"
 #include <array>
 #include <string>
+#include <vector>
 
 /**
  * Terminal display with in-place line rewriting
@@ -14,16 +18,27 @@ class Display
 {
 private:
     static constexpr size_t max_events = 10;
-    std::array<std::string, max_events> events {};
+    std::array<TraceEvent, max_events> events {};
     size_t head = 0;
     size_t count = 0;
+    bool enabled;
 
 public:
     /**
-     * Add a line to the display
+     * A disabled display ignores events and never touches the terminal
      */
-    void add_event (const std::string& event)
+    Display (bool enabled = true) : enabled (enabled) {}
+
+    bool is_enabled () const { return enabled; }
+
+    /**
+     * Add an event to the display, formatted only when rendered
+     */
+    void add_event (const TraceEvent& event)
     {
+        if (!enabled)
+            return;
+
         events[head] = event;
         head = (head + 1) % max_events;
         if (count < max_events)
@@ -31,11 +46,15 @@ public:
     }
 
     /**
-     * Show display
+     * Show display, details are extra lines below stats
      */
     void render (const std::string& header,
-                 const std::string& stats)
+                 const std::string& stats,
+                 const std::vector<std::string>& details = {})
     {
+        if (!enabled)
+            return;
+
         std::printf ("\033[H");
 
         auto line = [] (const std::string& text)
@@ -45,6 +64,8 @@ public:
 
         line (header);
         line (stats);
+        for (const std::string& detail : details)
+            line (detail);
         line ("");
         line ("Recent:");
 
@@ -52,7 +73,7 @@ public:
         for (size_t i = 0; i < max_events; ++i)
         {
             if (i < count)
-                line ("  " + events[(start + i) % max_events]);
+                line ("  " + format_event (events[(start + i) % max_events]));
             else
                 line ("");
         }
@@ -0,0 +1,100 @@
+/**
+ * @file exporter.h
+ * @brief Periodic machine-readable metrics export
+ */
+
+#pragma once
+
+#include "types.h"
+#include "helpers.h"
+#include "metrics.h"
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+/**
+ * Appends one JSON line per interval with a snapshot of a *Metrics struct.
+ * Counters are cumulative; consumers diff consecutive lines for rates.
+ */
+class MetricsExporter
+{
+private:
+    FILE* file = nullptr;
+    ms_t interval;
+    ms_t next_ms;
+    const SectionProfiler* profiler = nullptr;
+
+public:
+    /**
+     * Opens path for appending, exporter is inert if path is null
+     */
+    MetricsExporter (const char* path, ms_t interval = 1000)
+        : interval (interval), next_ms (get_time_ms () + interval)
+    {
+        if (path == nullptr)
+            return;
+
+        file = std::fopen (path, "a");
+        if (file == nullptr)
+            std::cerr << "Could not open metrics file " << path << std::endl;
+    }
+
+    ~MetricsExporter ()
+    {
+        if (file != nullptr)
+            std::fclose (file);
+    }
+
+    MetricsExporter (const MetricsExporter&) = delete;
+    MetricsExporter& operator = (const MetricsExporter&) = delete;
+
+    bool is_open () const { return file != nullptr; }
+
+    /**
+     * Add a "profile" object with the profiler's per-packet totals to
+     * each snapshot
+     */
+    void set_profiler (const SectionProfiler* sections)
+    {
+        profiler = sections;
+    }
+
+    /**
+     * Write a snapshot if the interval elapsed. One clock read otherwise.
+     */
+    template <typename Metrics>
+    void tick (const Metrics& metrics)
+    {
+        if (file == nullptr)
+            return;
+
+        ms_t now = get_time_ms ();
+        if (now < next_ms)
+            return;
+
+        next_ms = now + interval;
+        write (metrics);
+    }
+
+    /**
+     * Write a snapshot now, e.g. the final one before exiting
+     */
+    template <typename Metrics>
+    void write (const Metrics& metrics)
+    {
+        if (file == nullptr)
+            return;
+
+        std::string profile;
+        if (profiler != nullptr)
+            profile = ",\"profile\":"
+                    + to_json (*profiler, packet_count (metrics));
+
+        std::fprintf (file, "{\"time_ms\":%lld,%s%s}\n",
+                      (long long) get_time_ms (), to_json (metrics).c_str (),
+                      profile.c_str ());
+
+        // One write per snapshot so a killed run keeps its history
+        std::fflush (file);
+    }
+};
@@ -0,0 +1,110 @@
+/**
+ * @file handoff.h
+ * @brief Zero-copy handoff of delivered payloads to an application thread
+ */
+
+#pragma once
+
+#include "types.h"
+#include "ring.h"
+#include "connection.h"
+#include <algorithm>
+#include <atomic>
+#include <span>
+
+/**
+ * Publishes a Connection's in-order payloads, by reference, to one
+ * consumer thread through an SPSC ring.
+ *
+ * The network thread calls pump () after every service (). Payloads stay
+ * in the connection's buffers until the consumer releases them, and
+ * pump () only then consumes them from the connection. Publishing stops
+ * at the watermark instead of blocking, leaving later payloads buffered
+ * in the connection until the consumer catches up.
+ *
+ * The connection's own peek ()/recv ()/consume () must not be used
+ * alongside a handoff.
+ */
+class DeliveryHandoff
+{
+private:
+    SpscRing<std::span<const byte_t>> ring;
+    size_t watermark;
+
+    // Network thread only
+    size_t published = 0;
+    size_t reclaimed = 0;
+
+    std::atomic<bool> closed {false};
+
+public:
+    explicit DeliveryHandoff (size_t watermark = 1024)
+        : ring (std::max<size_t> (watermark, 1)),
+          watermark (std::max<size_t> (watermark, 1)) {}
+
+    DeliveryHandoff (const DeliveryHandoff&) = delete;
+    DeliveryHandoff& operator = (const DeliveryHandoff&) = delete;
+
+    /**** NETWORK THREAD ****/
+
+    /**
+     * Return released payloads to the connection and publish newly
+     * delivered ones up to the watermark. Never blocks. Returns the
+     * number published.
+     */
+    size_t pump (Connection& conn)
+    {
+        size_t released = published - ring.size ();
+        for (; reclaimed < released; ++reclaimed)
+            conn.consume ();
+
+        size_t count = 0;
+        while (published - reclaimed < watermark)
+        {
+            size_t index = published - reclaimed;
+            if (index >= conn.ready_count ())
+                break;
+
+            ring.try_push (conn.peek (index));
+            ++published;
+            ++count;
+        }
+
+        // The fin is only delivered behind all data, so nothing follows
+        if (conn.peer_finished ()
+            && published - reclaimed == conn.ready_count ())
+            closed.store (true, std::memory_order_release);
+
+        return count;
+    }
+
+    /**
+     * Payloads handed over and not yet released
+     */
+    size_t outstanding () const { return published - reclaimed; }
+
+    /**
+     * Everything up to the end of stream has been published
+     */
+    bool is_closed () const { return closed.load (std::memory_order_acquire); }
+
+    /**** CONSUMER THREAD ****/
+
+    /**
+     * Batch of published payloads in order, empty if none yet
+     */
+    std::span<std::span<const byte_t>> acquire ()
+    {
+        return ring.acquire_read ();
+    }
+
+    /**
+     * Done with the first n payloads of the last acquire ()
+     */
+    void release (size_t n) { ring.release_read (n); }
+
+    /**
+     * End of stream reached and every payload released
+     */
+    bool finished () const { return is_closed () && ring.size () == 0; }
+};
@@ -0,0 +1,221 @@
+/**
+ * @file aqm.h
+ * @brief Queue disciplines for a bottleneck queue with real sojourn times
+ */
+
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+/**
+ * What a queue discipline does with a packet
+ */
+enum class QueueVerdict : byte_t
+{
+    Pass    = 0,
+    Mark    = 1,    // set congestion experienced, only if ECN is on
+    Drop    = 2,
+};
+
+/**
+ * Active queue management on one FIFO. The queue calls on_enqueue () for
+ * each arriving packet and on_dequeue () for each departing one, and
+ * acts on the verdicts. A Mark on a packet that is not ECN capable is
+ * treated as a Drop.
+ */
+class QueueDiscipline
+{
+public:
+    virtual ~QueueDiscipline () = default;
+
+    /**
+     * Packet arriving behind backlog queued packets
+     */
+    virtual QueueVerdict on_enqueue (size_t backlog, ns_t now_ns)
+    {
+        return QueueVerdict::Pass;
+    }
+
+    /**
+     * Packet leaving after sojourn_ns queued, backlog packets behind it
+     */
+    virtual QueueVerdict on_dequeue (ns_t sojourn_ns, size_t backlog,
+                                     ns_t now_ns)
+    {
+        return QueueVerdict::Pass;
+    }
+};
+
+/**
+ * Random Early Detection (Floyd & Jacobson 1993). Signals with a
+ * probability rising linearly from 0 to max_p as the average queue goes
+ * from min_th to max_th packets, spread evenly by the count since the
+ * last signal. Above max_th everything drops.
+ */
+class Red : public QueueDiscipline
+{
+private:
+    double min_th;
+    double max_th;
+    double max_p;
+    double weight;
+    bool ecn;
+
+    double average = 0.0;
+    long count = -1;        // packets since the last signal
+
+    std::default_random_engine rng;
+    std::uniform_real_distribution<double> uniform {0.0, 1.0};
+
+public:
+    /**
+     * Defaults suit a queue of a few dozen packets
+     */
+    Red (double min_th = 5, double max_th = 15, double max_p = 0.1,
+         bool ecn = false, unsigned int seed = 0, double weight = 0.002)
+        : min_th (min_th), max_th (std::max (max_th, min_th + 1)),
+          max_p (max_p), weight (weight), ecn (ecn), rng (seed) {}
+
+    QueueVerdict on_enqueue (size_t backlog, ns_t now_ns) override
+    {
+        average += weight * ((double) backlog - average);
+
+        if (average < min_th)
+        {
+            count = -1;
+            return QueueVerdict::Pass;
+        }
+
+        if (average >= max_th)
+        {
+            count = 0;
+            return QueueVerdict::Drop;
+        }
+
+        ++count;
+        double p_b = max_p * (average - min_th) / (max_th - min_th);
+        double p_a = count * p_b < 1.0 ? p_b / (1.0 - count * p_b) : 1.0;
+        if (uniform (rng) >= p_a)
+            return QueueVerdict::Pass;
+
+        count = 0;
+        return ecn ? QueueVerdict::Mark : QueueVerdict::Drop;
+    }
+};
+
+/**
+ * Controlled Delay (RFC 8289). Once every packet for an interval has
+ * waited longer than target, signals one packet and then ever more
+ * often, interval / sqrt (count) apart, until sojourn times fall back
+ * under target. The queue never signals its last packet.
+ */
+class CoDel : public QueueDiscipline
+{
+private:
+    ns_t target_ns;
+    ns_t interval_ns;
+    bool ecn;
+
+    ns_t first_above_ns = 0;
+    ns_t signal_next_ns = 0;
+    size_t count = 0;
+    size_t last_count = 0;
+    bool signalling = false;
+
+    ns_t control_law (ns_t from_ns) const
+    {
+        return from_ns + (ns_t) (interval_ns / std::sqrt ((double) count));
+    }
+
+    /**
+     * Sojourn has stayed above target for a whole interval
+     */
+    bool persistently_above (ns_t sojourn_ns, size_t backlog, ns_t now_ns)
+    {
+        if (sojourn_ns < target_ns || backlog == 0)
+        {
+            first_above_ns = 0;
+            return false;
+        }
+
+        if (first_above_ns == 0)
+        {
+            first_above_ns = now_ns + interval_ns;
+            return false;
+        }
+
+        return now_ns >= first_above_ns;
+    }
+
+public:
+    CoDel (ms_t target = 5, ms_t interval = 100, bool ecn = false)
+        : target_ns (target * 1000000), interval_ns (interval * 1000000),
+          ecn (ecn) {}
+
+    QueueVerdict on_dequeue (ns_t sojourn_ns, size_t backlog,
+                             ns_t now_ns) override
+    {
+        QueueVerdict signal = ecn ? QueueVerdict::Mark : QueueVerdict::Drop;
+        bool above = persistently_above (sojourn_ns, backlog, now_ns);
+
+        if (signalling)
+        {
+            if (!above)
+            {
+                signalling = false;
+                return QueueVerdict::Pass;
+            }
+
+            if (now_ns < signal_next_ns)
+                return QueueVerdict::Pass;
+
+            ++count;
+            signal_next_ns = control_law (signal_next_ns);
+            return signal;
+        }
+
+        if (!above)
+            return QueueVerdict::Pass;
+
+        // Resume near the previous rate if the last episode was recent
+        signalling = true;
+        size_t delta = count - last_count;
+        count = delta > 1 && now_ns - signal_next_ns < 16 * interval_ns
+              ? delta : 1;
+        last_count = count;
+        signal_next_ns = control_law (now_ns);
+        return signal;
+    }
+};
+
+/**
+ * Build a queue discipline by its command line name. params are
+ * constructor arguments in order (thresholds in packets, times in ms),
+ * missing ones take their defaults. Returns nullptr for unknown names.
+ */
+inline std::unique_ptr<QueueDiscipline> make_queue_discipline (
+    const std::string& name, const std::vector<double>& params = {},
+    bool ecn = false, unsigned int seed = 0)
+{
+    auto param = [&] (size_t ind, double fallback)
+    {
+        return ind < params.size () ? params[ind] : fallback;
+    };
+
+    if (name == "fifo")
+        return std::make_unique<QueueDiscipline> ();
+    if (name == "red")
+        return std::make_unique<Red> (param (0, 5), param (1, 15),
+                                      param (2, 0.1), ecn, seed);
+    if (name == "codel")
+        return std::make_unique<CoDel> ((ms_t) param (0, 5),
+                                        (ms_t) param (1, 100), ecn);
+
+    return nullptr;
+}
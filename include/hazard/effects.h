@@ -13,5 +13,5 @@
 struct Effects
 {
     bool drop;
-    ms_t delay;
+    ns_t delay_ns;
 };
\ No newline at end of file
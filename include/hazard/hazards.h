@@ -10,6 +10,9 @@
 #include "helpers.h"
 #include <random>
 #include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
 #include <packet.h>
 
 /**
@@ -47,8 +50,8 @@ public:
     {
         return Effects
         {
-            .drop  = drop_dist (rng),
-            .delay = ms_t {0}
+            .drop = drop_dist (rng),
+            .delay_ns = 0
         };
     }
 };
@@ -77,7 +80,7 @@ public:
     Effects get_effects (PacketType type, id_t id) override
     {
         Effects effects {};
-        effects.delay = ms_t {0};
+        effects.delay_ns = 0;
 
         if (loss_dist (rng))
             ++drop_count;
@@ -123,7 +126,7 @@ public:
     {
         // Acks are tiny, only buffer data (forward path)
         if (type == PacketType::Ack)
-            return Effects {.drop = false, .delay = ms_t {0}};
+            return Effects {.drop = false, .delay_ns = 0};
 
         ms_t now = get_time_ms ();
         if (now > last_drain)
@@ -136,10 +139,10 @@ public:
         }
 
         if (occupied >= capacity)
-            return Effects {.drop = true, .delay = ms_t {0}};
+            return Effects {.drop = true, .delay_ns = 0};
 
         ++occupied;
-        return Effects {.drop = false, .delay = ms_t {0}};
+        return Effects {.drop = false, .delay_ns = 0};
     }
 };
 
@@ -165,7 +168,36 @@ public:
         return Effects
         {
             .drop = false,
-            .delay = std::max (static_cast<ms_t> (dist (rng)), ms_t {0})
+            .delay_ns = (ns_t) (std::max (dist (rng), 0.0) * 1e6)
         };
     }
-};
\ No newline at end of file
+};
+
+/**
+ * Build a hazard by its command line name. params are constructor
+ * arguments in order, missing ones take their defaults. Returns nullptr
+ * for unknown names.
+ */
+inline std::unique_ptr<HazardProfile> make_hazard (
+    const std::string& name, const std::vector<double>& params = {},
+    unsigned int seed = 0)
+{
+    auto param = [&] (size_t ind, double fallback)
+    {
+        return ind < params.size () ? params[ind] : fallback;
+    };
+
+    if (name == "random-loss")
+        return std::make_unique<RandomLoss> (param (0, 0.05), seed);
+    if (name == "burst-loss")
+        return std::make_unique<BurstLoss> (param (0, 0.05), param (1, 0.005),
+                                            seed);
+    if (name == "shallow-buffer")
+        return std::make_unique<ShallowBuffer> ((size_t) param (0, 5),
+                                                param (1, 60.0));
+    if (name == "random-jitter")
+        return std::make_unique<RandomJitter> ((ms_t) param (0, 100),
+                                               (ms_t) param (1, 80), seed);
+
+    return nullptr;
+}
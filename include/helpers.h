@@ -5,7 +5,12 @@
 
 #pragma once
 
+#include "types.h"
+#include <bit>
 #include <chrono>
+#include <endian.h>
+#include <cstring>
+#include <span>
 
 /*
  * ns_t to ms_t conversion
@@ -23,11 +28,67 @@ inline us_t sec_to_us (sec_t ts)
     return (us_t) (ts * 1000000);
 }
 
+/**
+ * 64-bit checksum in the style of xxHash64: four independent lanes over
+ * 8-byte words, so the multiplies overlap, folded and then finished over
+ * the tail. Chainable across chunks through seed, so both ends must
+ * split the data alike.
+ */
+inline uint64_t checksum64 (std::span<const byte_t> data,
+                            uint64_t seed = 0x27d4eb2f165667c5ULL)
+{
+    constexpr uint64_t prime1 = 0x9e3779b185ebca87ULL;
+    constexpr uint64_t prime2 = 0xc2b2ae3d27d4eb4fULL;
+    auto round = [] (uint64_t acc, uint64_t word)
+    {
+        return std::rotl (acc + word * prime2, 31) * prime1;
+    };
+    auto word_at = [&data] (size_t ind)
+    {
+        uint64_t word;
+        memcpy (&word, data.data () + ind, sizeof word);
+        return le64toh (word);
+    };
+
+    uint64_t hash = seed;
+    size_t ind = 0;
+    if (data.size () >= 32)
+    {
+        uint64_t lanes[4] = {seed + prime1, seed ^ prime2, seed, seed - prime1};
+        for (; ind + 32 <= data.size (); ind += 32)
+            for (size_t lane = 0; lane < 4; ++lane)
+                lanes[lane] = round (lanes[lane], word_at (ind + 8 * lane));
+
+        for (uint64_t lane : lanes)
+            hash = round (hash, lane);
+    }
+
+    for (; ind + 8 <= data.size (); ind += 8)
+        hash = round (hash, word_at (ind));
+    for (; ind < data.size (); ++ind)
+        hash = (hash ^ data[ind]) * prime1;
+
+    return hash;
+}
+
+/**
+ * Simulated time. While enabled on a thread, get_time_ns on that thread
+ * returns now_ns instead of reading the steady clock.
+ */
+struct VirtualClock
+{
+    static inline thread_local bool enabled = false;
+    static inline thread_local ns_t now_ns = 0;
+};
+
 /**
  * Get current time in nanoseconds
  */
 inline ns_t get_time_ns ()
 {
+    if (VirtualClock::enabled)
+        return VirtualClock::now_ns;
+
     auto now = std::chrono::steady_clock::now ();
     return ns_t {std::chrono::duration_cast<std::chrono::nanoseconds> (
                     now.time_since_epoch ()).count ()};
@@ -40,3 +101,27 @@ inline ms_t get_time_ms ()
 {
     return ns_to_ms (get_time_ns ());
 }
+
+/**
+ * True if flag appears anywhere in argv
+ */
+inline bool has_flag (int argc, char* argv[], const char* flag)
+{
+    for (int i = 1; i < argc; ++i)
+        if (std::strcmp (argv[i], flag) == 0)
+            return true;
+
+    return false;
+}
+
+/**
+ * Value following option in argv, or nullptr if absent
+ */
+inline const char* get_option (int argc, char* argv[], const char* option)
+{
+    for (int i = 1; i + 1 < argc; ++i)
+        if (std::strcmp (argv[i], option) == 0)
+            return argv[i + 1];
+
+    return nullptr;
+}
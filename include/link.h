@@ -0,0 +1,105 @@
+/**
+ * @file link.h
+ * @brief Packet I/O underneath a Connection
+ */
+
+#pragma once
+
+#include "network.h"
+#include "buffer.h"
+#include <span>
+#include <unistd.h>
+
+/**
+ * Moves packets between a Connection and its peer. Receives never block.
+ */
+class PacketLink
+{
+public:
+    virtual ~PacketLink () = default;
+
+    /**
+     * Descriptor to poll for incoming packets, -1 if not pollable
+     */
+    virtual int fd () const { return -1; }
+
+    virtual ssize_t send_data (const PacketHeader& header,
+                               std::span<const byte_t> payload) = 0;
+    virtual ssize_t send_ack (const AckPacket& ack) = 0;
+
+    /**
+     * Next incoming packet, < 1 if none. arrival_ns is when it reached
+     * the host on the get_time_ns () clock, as precisely as the link can
+     * tell.
+     */
+    virtual ssize_t receive (UnionPacket& packet, ns_t& arrival_ns) = 0;
+
+    /**
+     * True if the link already holds incoming packets in PacketPool
+     * blocks. Such links are read with receive_ref (), which hands the
+     * block over instead of copying it out.
+     */
+    virtual bool pooled () const { return false; }
+
+    /**
+     * Next incoming packet of a pooled link, false if none
+     */
+    virtual bool receive_ref (PacketRef&, ns_t&) { return false; }
+};
+
+/**
+ * UDP socket bound to a local port, talking to one peer
+ */
+class UdpLink : public PacketLink
+{
+private:
+    int sock = -1;
+    sockaddr_in peer_addr {};
+
+public:
+    UdpLink (int bind_port, const char* peer_ip, int peer_port)
+    {
+        sock = create_udp_socket ();
+        if (sock < 0)
+            return;
+
+        if (bind_socket (sock, bind_port) < 0)
+        {
+            std::cerr << "Issue binding port " << bind_port << std::endl;
+            close_socket (sock);
+            sock = -1;
+            return;
+        }
+
+        set_nonblocking (sock);
+        enable_rx_timestamps (sock);
+        peer_addr = make_dest_addr (peer_ip, peer_port);
+    }
+
+    ~UdpLink () override
+    {
+        if (sock >= 0)
+            close_socket (sock);
+    }
+
+    UdpLink (const UdpLink&) = delete;
+    UdpLink& operator = (const UdpLink&) = delete;
+
+    int fd () const override { return sock; }
+
+    ssize_t send_data (const PacketHeader& header,
+                       std::span<const byte_t> payload) override
+    {
+        return send_data_view (sock, header, payload, peer_addr);
+    }
+
+    ssize_t send_ack (const AckPacket& ack) override
+    {
+        return ::send_ack (sock, ack, peer_addr);
+    }
+
+    ssize_t receive (UnionPacket& packet, ns_t& arrival_ns) override
+    {
+        return receive_packet (sock, packet, nullptr, &arrival_ns);
+    }
+};
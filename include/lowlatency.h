@@ -0,0 +1,171 @@
+/**
+ * @file lowlatency.h
+ * @brief CPU pinning, busy polling and real-time scheduling for a run
+ */
+
+#pragma once
+
+#include "types.h"
+#include "helpers.h"
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+/**
+ * How a binary trades CPU for steadier latency, all off by default
+ */
+struct LowLatencyOptions
+{
+    // Network thread on the first, helper threads on the rest
+    std::vector<int> cpus {};
+
+    // Spin on zero-timeout polls instead of sleeping, and have the
+    // kernel busy poll the sockets for this long where it allows
+    bool busy_poll = false;
+    int busy_poll_us = 50;
+
+    // SCHED_FIFO priority for the network thread, 0 keeps the default
+    int fifo_priority = 0;
+};
+
+/**
+ * Read --cpus list, --busy-poll and --fifo priority. Returns nullopt
+ * if malformed.
+ */
+inline std::optional<LowLatencyOptions> parse_low_latency (int argc,
+                                                           char* argv[])
+{
+    LowLatencyOptions options {.busy_poll = has_flag (argc, argv,
+                                                      "--busy-poll")};
+
+    if (const char* list = get_option (argc, argv, "--cpus"))
+    {
+        const char* cursor = list;
+        while (*cursor != '\0')
+        {
+            char* end = nullptr;
+            long cpu = std::strtol (cursor, &end, 10);
+            if (end == cursor || cpu < 0 || cpu >= CPU_SETSIZE
+                || (*end != ',' && *end != '\0'))
+            {
+                std::cerr << "Bad cpu list " << list << std::endl;
+                return std::nullopt;
+            }
+
+            options.cpus.push_back ((int) cpu);
+            cursor = *end == ',' ? end + 1 : end;
+        }
+    }
+
+    if (const char* priority = get_option (argc, argv, "--fifo"))
+    {
+        options.fifo_priority = atoi (priority);
+        if (options.fifo_priority < sched_get_priority_min (SCHED_FIFO)
+            || options.fifo_priority > sched_get_priority_max (SCHED_FIFO))
+        {
+            std::cerr << "Bad SCHED_FIFO priority " << priority << std::endl;
+            return std::nullopt;
+        }
+    }
+
+    return options;
+}
+
+/**
+ * Applies LowLatencyOptions to a process. Construct it before starting
+ * helper threads (tracer, capture and file writers) so they inherit the
+ * helper cpus, and call enter () from the network thread once they are
+ * running. Settings the kernel refuses are reported and skipped.
+ */
+class LowLatencyMode
+{
+private:
+    LowLatencyOptions options;
+
+    static bool set_affinity (std::vector<int>::const_iterator first,
+                              std::vector<int>::const_iterator last)
+    {
+        cpu_set_t set;
+        CPU_ZERO (&set);
+        for (auto it = first; it != last; ++it)
+            CPU_SET (*it, &set);
+
+        return pthread_setaffinity_np (pthread_self (), sizeof (set),
+                                       &set) == 0;
+    }
+
+public:
+    explicit LowLatencyMode (const LowLatencyOptions& options)
+        : options (options)
+    {
+        const std::vector<int>& cpus = options.cpus;
+        if (cpus.size () > 1 && !set_affinity (cpus.begin () + 1, cpus.end ()))
+            std::cerr << "Could not move helper threads off cpu " << cpus[0]
+                      << std::endl;
+    }
+
+    bool busy_polling () const { return options.busy_poll; }
+
+    /**
+     * Ask the kernel to busy poll a socket's device queue on receive
+     */
+    void tune_socket (int sock) const
+    {
+        if (!options.busy_poll)
+            return;
+
+        setsockopt (sock, SOL_SOCKET, SO_BUSY_POLL, &options.busy_poll_us,
+                    sizeof (options.busy_poll_us));
+    }
+
+    /**
+     * Pin the calling thread to the first cpu and give it SCHED_FIFO,
+     * locking memory so it does not page fault
+     */
+    void enter () const
+    {
+        const std::vector<int>& cpus = options.cpus;
+        if (!cpus.empty () && !set_affinity (cpus.begin (), cpus.begin () + 1))
+            std::cerr << "Could not pin to cpu " << cpus[0] << std::endl;
+
+        if (options.fifo_priority == 0)
+            return;
+
+        sched_param param {.sched_priority = options.fifo_priority};
+        if (pthread_setschedparam (pthread_self (), SCHED_FIFO, &param) != 0)
+        {
+            std::cerr << "Could not get SCHED_FIFO, needs CAP_SYS_NICE"
+                      << std::endl;
+            return;
+        }
+
+        mlockall (MCL_CURRENT | MCL_FUTURE);
+    }
+
+    /**
+     * poll (), but spinning on zero timeouts while busy polling. A
+     * negative timeout waits forever either way.
+     */
+    int poll (pollfd* fds, nfds_t count, int timeout_ms) const
+    {
+        if (!options.busy_poll)
+            return ::poll (fds, count, timeout_ms);
+
+        ns_t deadline_ns = get_time_ns () + (ns_t) timeout_ms * 1000000;
+        while (true)
+        {
+            int ready = ::poll (fds, count, 0);
+            if (ready != 0 || (timeout_ms >= 0
+                               && get_time_ns () >= deadline_ns))
+                return ready;
+        }
+    }
+};
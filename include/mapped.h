@@ -0,0 +1,185 @@
+/**
+ * @file mapped.h
+ * @brief Memory-mapped transfer source and pwrite transfer sink
+ */
+
+#pragma once
+
+#include "types.h"
+#include "helpers.h"
+#include <cerrno>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <span>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Read-only bytes to transfer. Either a file mapped straight from the
+ * page cache, or the synthetic payload where chunk i is filled with i.
+ * Packets reference the mapping instead of copying out of it.
+ */
+class MappedSource
+{
+private:
+    byte_t* base = nullptr;
+    size_t length = 0;
+    bool open = false;
+
+public:
+    /**
+     * Map a file for reading
+     */
+    explicit MappedSource (const char* path)
+    {
+        int fd = ::open (path, O_RDONLY);
+        if (fd < 0)
+        {
+            std::cerr << "Could not open " << path << ": "
+                      << std::strerror (errno) << std::endl;
+            return;
+        }
+
+        struct stat st {};
+        if (fstat (fd, &st) < 0)
+        {
+            ::close (fd);
+            return;
+        }
+
+        length = (size_t) st.st_size;
+        open = true;
+
+        // Empty files have nothing to map
+        if (length > 0)
+        {
+            void* addr = mmap (nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (addr == MAP_FAILED)
+            {
+                std::cerr << "Could not map " << path << std::endl;
+                open = false;
+                length = 0;
+            }
+            else
+            {
+                base = (byte_t*) addr;
+                madvise (base, length, MADV_SEQUENTIAL);
+            }
+        }
+
+        ::close (fd);
+    }
+
+    /**
+     * Synthetic payload of count chunks, chunk i filled with (i & 0xFF)
+     */
+    MappedSource (size_t count, size_t chunk_size)
+        : length (count * chunk_size)
+    {
+        void* addr = mmap (nullptr, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (addr == MAP_FAILED)
+            return;
+
+        base = (byte_t*) addr;
+        for (size_t ind = 0; ind < count; ++ind)
+            memset (base + ind * chunk_size, (byte_t) (ind & 0xFF),
+                    chunk_size);
+
+        open = true;
+    }
+
+    ~MappedSource ()
+    {
+        if (base != nullptr)
+            munmap (base, length);
+    }
+
+    MappedSource (const MappedSource&) = delete;
+    MappedSource& operator = (const MappedSource&) = delete;
+
+    bool is_open () const { return open; }
+    size_t size () const { return length; }
+
+    /**
+     * Number of chunk_size chunks, last one may be short
+     */
+    size_t chunk_count (size_t chunk_size) const
+    {
+        return (length + chunk_size - 1) / chunk_size;
+    }
+
+    /**
+     * View of chunk index, pointing into the mapping
+     */
+    std::span<const byte_t> chunk (size_t index, size_t chunk_size) const
+    {
+        size_t offset = index * chunk_size;
+        return {base + offset, std::min (chunk_size, length - offset)};
+    }
+};
+
+/**
+ * Output file written in delivery order with pwrite, no staging buffer
+ */
+class FileSink
+{
+private:
+    int fd = -1;
+    size_t offset = 0;
+
+public:
+    explicit FileSink (const char* path)
+    {
+        if (path == nullptr)
+            return;
+
+        fd = ::open (path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            std::cerr << "Could not open " << path << ": "
+                      << std::strerror (errno) << std::endl;
+    }
+
+    ~FileSink ()
+    {
+        if (fd >= 0)
+            ::close (fd);
+    }
+
+    FileSink (const FileSink&) = delete;
+    FileSink& operator = (const FileSink&) = delete;
+
+    bool is_open () const { return fd >= 0; }
+    size_t size () const { return offset; }
+
+    /**
+     * Append data at the current offset. Returns false on write failure.
+     */
+    bool write (std::span<const byte_t> data)
+    {
+        while (!data.empty ())
+        {
+            ssize_t ret = pwrite (fd, data.data (), data.size (), offset);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+
+            offset += (size_t) ret;
+            data = data.subspan ((size_t) ret);
+        }
+
+        return true;
+    }
+
+    /**
+     * Flush to disk. Returns false on failure.
+     */
+    bool finish ()
+    {
+        return fd < 0 || fsync (fd) == 0;
+    }
+};
@@ -6,10 +6,136 @@
 #pragma once
 
 #include "types.h"
+#include "perf.h"
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <cmath>
 #include <string>
+#include <vector>
 #include <cstdio>
 
+/**
+ * Fixed-memory latency histogram in the style of HdrHistogram.
+ *
+ * Each power of two is split into 64 linear sub-buckets, so any recorded
+ * value is reported within ~1.6% of its true value. Covers 0 to ~18 min
+ * in nanoseconds; larger samples are clamped into the top bucket.
+ */
+class LatencyHistogram
+{
+private:
+    static constexpr size_t sub_bits    = 7;
+    static constexpr size_t sub_count   = 1 << sub_bits;
+    static constexpr size_t half_count  = sub_count / 2;
+    static constexpr size_t max_bits    = 40;
+    static constexpr size_t slot_count  = (max_bits - sub_bits + 2)
+                                        * half_count;
+
+    std::array<uint64_t, slot_count> counts {};
+    size_t total = 0;
+    double sum_ns = 0.0;
+    ns_t min_ns = 0;
+    ns_t max_ns = 0;
+
+    /**
+     * Slot holding a value
+     */
+    static size_t index_of (uint64_t value)
+    {
+        value = std::min (value, (uint64_t {1} << max_bits) - 1);
+        size_t width = std::bit_width (value);
+        size_t bucket = width > sub_bits ? width - sub_bits : 0;
+
+        return bucket * half_count + (value >> bucket);
+    }
+
+    /**
+     * Highest value that maps to a slot
+     */
+    static ns_t value_at (size_t index)
+    {
+        if (index < sub_count)
+            return (ns_t) index;
+
+        size_t bucket = index / half_count - 1;
+        size_t sub = index - bucket * half_count;
+        return (ns_t) (((sub + 1) << bucket) - 1);
+    }
+
+public:
+    /**
+     * Record one sample, negative samples count as zero
+     */
+    void record (ns_t value)
+    {
+        value = std::max (value, ns_t {0});
+        ++counts[index_of ((uint64_t) value)];
+
+        min_ns = (total == 0) ? value : std::min (min_ns, value);
+        max_ns = std::max (max_ns, value);
+        sum_ns += (double) value;
+        ++total;
+    }
+
+    /**
+     * Value at or below which q percent of samples fall
+     */
+    ns_t percentile (double q) const
+    {
+        if (total == 0)
+            return 0;
+
+        size_t target = std::max<size_t> (
+            1, (size_t) std::ceil (q / 100.0 * (double) total));
+
+        size_t seen = 0;
+        for (size_t ind = 0; ind < slot_count; ++ind)
+        {
+            seen += counts[ind];
+            if (seen >= target)
+                return std::min (value_at (ind), max_ns);
+        }
+
+        return max_ns;
+    }
+
+    /**
+     * Add another histogram's samples, e.g. across repeated runs
+     */
+    void merge (const LatencyHistogram& other)
+    {
+        if (other.total == 0)
+            return;
+
+        for (size_t ind = 0; ind < slot_count; ++ind)
+            counts[ind] += other.counts[ind];
+
+        min_ns = (total == 0) ? other.min_ns : std::min (min_ns, other.min_ns);
+        max_ns = std::max (max_ns, other.max_ns);
+        sum_ns += other.sum_ns;
+        total += other.total;
+    }
+
+    size_t count () const { return total; }
+    ns_t min () const { return min_ns; }
+    ns_t max () const { return max_ns; }
+    double mean () const { return total > 0 ? sum_ns / total : 0.0; }
+
+    /**
+     * One-line tail summary in milliseconds
+     */
+    std::string summary (const std::string& name) const
+    {
+        char buf[128];
+        std::snprintf (buf, sizeof (buf),
+                       "%s p50: %.2f  p99: %.2f  p99.9: %.2f ms",
+                       name.c_str (), percentile (50.0) / 1e6,
+                       percentile (99.0) / 1e6, percentile (99.9) / 1e6);
+        return buf;
+    }
+};
+
 /**
  * Sender metrics
  */
@@ -18,7 +144,17 @@ struct SenderMetrics
     size_t total_sent;
     size_t unique_sent;
     size_t bytes_sent;
-    float mean_latency;
+    float mean_latency;         // mean rtt, ms
+    size_t in_flight;
+    size_t cwnd;                // congestion window, packets
+    size_t ecn_reductions;      // window cuts on echoed marks
+    size_t peer_window;         // receive window last advertised
+    size_t window_probes;       // packets sent into a closed window
+    size_t abandoned;           // expired before being acked
+    size_t messages_sent;       // bundled, or fully split into the window
+    size_t bundles_sent;        // packets carrying several messages
+    LatencyHistogram rtt;
+    LatencyHistogram wakeup;    // ack arrival -> picked up
 };
 
 /**
@@ -29,6 +165,29 @@ struct ReceiverMetrics
     size_t total_received;
     size_t unique_received;
     size_t bytes_received;
+    size_t buffered;
+    size_t acks_sent;
+    size_t ce_received;         // data marked congestion experienced
+    size_t refused;             // data past the advertised window
+    size_t skipped;             // abandoned by the sender, never arrived
+    size_t messages_received;   // reassembled whole
+    size_t messages_dropped;    // missing abandoned fragments
+    LatencyHistogram one_way;   // sender transmit -> receiver arrival
+    LatencyHistogram hol_wait;  // arrival -> in-order delivery
+    LatencyHistogram wakeup;    // data arrival -> picked up
+};
+
+/**
+ * Per-flow emulator metrics
+ */
+struct FlowMetrics
+{
+    size_t fwd_data;
+    size_t fwd_acks;
+    size_t fwd_bytes;
+    size_t dropped;
+    size_t queued;          // waiting for the bottleneck
+    size_t marked;          // congestion experienced set by the queue
 };
 
 /**
@@ -38,5 +197,174 @@ struct EmulatorMetrics
 {
     size_t fwd_data;
     size_t fwd_acks;
-    size_t dropped;
-};
\ No newline at end of file
+    size_t dropped;         // by hazards, queue limit or discipline
+    size_t marked;
+    size_t queued;
+    size_t unrouted;        // from an address with no flow
+    size_t buffer_bytes;    // packet storage reserved for queues
+    size_t capture_dropped; // capture records lost to a full buffer
+    std::vector<FlowMetrics> flows;
+    LatencyHistogram wakeup;    // arrival or release deadline -> handled
+};
+
+/**
+ * JSON object for a histogram's tail, in milliseconds
+ */
+inline std::string to_json (const LatencyHistogram& hist)
+{
+    char buf[128];
+    std::snprintf (buf, sizeof (buf),
+                   "{\"count\":%zu,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f}",
+                   (std::size_t) hist.count (), hist.percentile (50.0) / 1e6,
+                   hist.percentile (99.0) / 1e6, hist.percentile (99.9) / 1e6);
+    return buf;
+}
+
+/**
+ * JSON fields of a sender snapshot
+ */
+inline std::string to_json (const SenderMetrics& metrics)
+{
+    char buf[512];
+    std::snprintf (buf, sizeof (buf),
+                   "\"total_sent\":%zu,\"unique_sent\":%zu,"
+                   "\"bytes_sent\":%zu,\"in_flight\":%zu,\"cwnd\":%zu,"
+                   "\"ecn_reductions\":%zu,\"peer_window\":%zu,"
+                   "\"window_probes\":%zu,\"abandoned\":%zu,"
+                   "\"messages_sent\":%zu,\"bundles_sent\":%zu,\"rtt\":",
+                   (std::size_t) metrics.total_sent,
+                   (std::size_t) metrics.unique_sent,
+                   (std::size_t) metrics.bytes_sent,
+                   (std::size_t) metrics.in_flight,
+                   (std::size_t) metrics.cwnd,
+                   (std::size_t) metrics.ecn_reductions,
+                   (std::size_t) metrics.peer_window,
+                   (std::size_t) metrics.window_probes,
+                   (std::size_t) metrics.abandoned,
+                   (std::size_t) metrics.messages_sent,
+                   (std::size_t) metrics.bundles_sent);
+    return buf + to_json (metrics.rtt) + ",\"wakeup\":"
+               + to_json (metrics.wakeup);
+}
+
+/**
+ * JSON fields of a receiver snapshot
+ */
+inline std::string to_json (const ReceiverMetrics& metrics)
+{
+    char buf[512];
+    std::snprintf (buf, sizeof (buf),
+                   "\"total_received\":%zu,\"unique_received\":%zu,"
+                   "\"bytes_received\":%zu,\"buffered\":%zu,"
+                   "\"acks_sent\":%zu,\"ce_received\":%zu,"
+                   "\"refused\":%zu,\"skipped\":%zu,"
+                   "\"messages_received\":%zu,\"messages_dropped\":%zu,"
+                   "\"one_way\":",
+                   (std::size_t) metrics.total_received,
+                   (std::size_t) metrics.unique_received,
+                   (std::size_t) metrics.bytes_received,
+                   (std::size_t) metrics.buffered,
+                   (std::size_t) metrics.acks_sent,
+                   (std::size_t) metrics.ce_received,
+                   (std::size_t) metrics.refused,
+                   (std::size_t) metrics.skipped,
+                   (std::size_t) metrics.messages_received,
+                   (std::size_t) metrics.messages_dropped);
+    return buf + to_json (metrics.one_way) + ",\"hol_wait\":"
+               + to_json (metrics.hol_wait) + ",\"wakeup\":"
+               + to_json (metrics.wakeup);
+}
+
+/**
+ * JSON fields of an emulator snapshot
+ */
+inline std::string to_json (const EmulatorMetrics& metrics)
+{
+    char buf[256];
+    std::snprintf (buf, sizeof (buf),
+                   "\"fwd_data\":%zu,\"fwd_acks\":%zu,"
+                   "\"dropped\":%zu,\"marked\":%zu,\"queued\":%zu,"
+                   "\"unrouted\":%zu,\"buffer_bytes\":%zu,"
+                   "\"capture_dropped\":%zu,\"flows\":[",
+                   (std::size_t) metrics.fwd_data,
+                   (std::size_t) metrics.fwd_acks,
+                   (std::size_t) metrics.dropped,
+                   (std::size_t) metrics.marked,
+                   (std::size_t) metrics.queued,
+                   (std::size_t) metrics.unrouted,
+                   (std::size_t) metrics.buffer_bytes,
+                   (std::size_t) metrics.capture_dropped);
+
+    std::string json = buf;
+    for (size_t ind = 0; ind < metrics.flows.size (); ++ind)
+    {
+        const FlowMetrics& flow = metrics.flows[ind];
+        std::snprintf (buf, sizeof (buf),
+                       "%s{\"fwd_data\":%zu,\"fwd_acks\":%zu,"
+                       "\"fwd_bytes\":%zu,\"dropped\":%zu,\"marked\":%zu,"
+                       "\"queued\":%zu}",
+                       ind > 0 ? "," : "",
+                       (std::size_t) flow.fwd_data,
+                       (std::size_t) flow.fwd_acks,
+                       (std::size_t) flow.fwd_bytes,
+                       (std::size_t) flow.dropped,
+                       (std::size_t) flow.marked,
+                       (std::size_t) flow.queued);
+        json += buf;
+    }
+
+    return json + "],\"wakeup\":" + to_json (metrics.wakeup);
+}
+
+/**
+ * Packets a snapshot's per-packet figures are divided by: data sent,
+ * data received, or everything the emulator forwarded or dropped. All
+ * cumulative, so figures do not drift with the queue.
+ */
+inline size_t packet_count (const SenderMetrics& metrics)
+{
+    return metrics.total_sent;
+}
+
+inline size_t packet_count (const ReceiverMetrics& metrics)
+{
+    return metrics.total_received;
+}
+
+inline size_t packet_count (const EmulatorMetrics& metrics)
+{
+    return metrics.fwd_data + metrics.fwd_acks + metrics.dropped;
+}
+
+/**
+ * JSON object with each section's calls and counters per packet.
+ * Counters are left out when unavailable.
+ */
+inline std::string to_json (const SectionProfiler& profiler, size_t packets)
+{
+    double per = 1.0 / (double) std::max<size_t> (packets, 1);
+    char buf[256];
+
+    std::string json = "{";
+    for (size_t ind = 0; ind < section_count; ++ind)
+    {
+        const SectionTotals& totals = profiler.totals ((Section) ind);
+        std::snprintf (buf, sizeof (buf), "%s\"%s\":{\"calls\":%.3f",
+                       ind > 0 ? "," : "", section_name ((Section) ind),
+                       totals.calls * per);
+        json += buf;
+
+        for (size_t counter = 0;
+             profiler.is_open () && counter < counter_count; ++counter)
+        {
+            std::snprintf (buf, sizeof (buf), ",\"%s\":%.1f",
+                           counter_name ((Counter) counter),
+                           totals.counters.values[counter] * per);
+            json += buf;
+        }
+
+        json += "}";
+    }
+
+    return json + "}";
+}
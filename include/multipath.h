@@ -0,0 +1,221 @@
+/**
+ * @file multipath.h
+ * @brief Striping a connection's packets across several paths
+ */
+
+#pragma once
+
+#include "link.h"
+#include "helpers.h"
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * What a MultipathLink knows about one path
+ */
+struct PathStats
+{
+    sockaddr_in addr;
+    size_t sent = 0;
+    size_t acked = 0;
+    size_t lost = 0;
+    double srtt_ms = 100.0;     // smoothed rtt, a guess until sampled
+    double loss = 0.0;          // smoothed loss ratio
+    double credit = 0.0;        // weighted round robin state
+
+    /**
+     * Share of traffic this path should carry: delivery rate estimate
+     */
+    double weight () const
+    {
+        return (1.0 - std::min (loss, 0.9)) / std::max (srtt_ms, 0.1);
+    }
+};
+
+/**
+ * One UDP socket talking to the peer over several paths, e.g. through
+ * one emulator each.
+ *
+ * Data is striped with smooth weighted round robin, weighting each path
+ * by its estimated delivery rate: (1 - loss) / srtt. Acks arrive on the
+ * path their data took and sample that path's rtt. A packet sent again
+ * before its ack counts as lost on the path it last took. Forward
+ * notices take the best path and are left out of this accounting. The
+ * receiving Connection merges the paths back into one ordered stream.
+ *
+ * With no paths configured the link learns them instead: each data
+ * packet's source becomes a path, and acks go back the way the latest
+ * data came.
+ */
+class MultipathLink : public PacketLink
+{
+private:
+    int sock = -1;
+    std::vector<PathStats> paths {};
+    std::unordered_map<uint64_t, size_t> path_index {};
+
+    // Path each unacked packet last left on
+    std::unordered_map<id_t, size_t> in_flight {};
+
+    size_t reply_path = 0;
+
+    static constexpr double gain = 1.0 / 8;
+
+    size_t find_or_add (const sockaddr_in& addr)
+    {
+        auto [it, added] = path_index.try_emplace (address_key (addr),
+                                                   paths.size ());
+        if (added)
+            paths.push_back ({.addr = addr});
+
+        return it->second;
+    }
+
+    /**
+     * Path with the most accumulated credit
+     */
+    size_t pick ()
+    {
+        double total = 0.0;
+        size_t best = 0;
+        for (size_t ind = 0; ind < paths.size (); ++ind)
+        {
+            paths[ind].credit += paths[ind].weight ();
+            total += paths[ind].weight ();
+            if (paths[ind].credit > paths[best].credit)
+                best = ind;
+        }
+
+        paths[best].credit -= total;
+        return best;
+    }
+
+    /**
+     * Credit the path a packet took, sample rtt if given
+     */
+    void on_acked (id_t id, ns_t rtt_ns)
+    {
+        auto it = in_flight.find (id);
+        if (it == in_flight.end ())
+            return;
+
+        PathStats& path = paths[it->second];
+        ++path.acked;
+        path.loss *= 1.0 - gain;
+        if (rtt_ns > 0)
+            path.srtt_ms += gain * (rtt_ns / 1e6 - path.srtt_ms);
+
+        in_flight.erase (it);
+    }
+
+public:
+    /**
+     * Stripe across peer_ports at peer_ip, or learn paths if none given
+     */
+    MultipathLink (int bind_port, const char* peer_ip,
+                   const std::vector<int>& peer_ports)
+    {
+        sock = create_udp_socket ();
+        if (sock < 0)
+            return;
+
+        if (bind_socket (sock, bind_port) < 0)
+        {
+            std::cerr << "Issue binding port " << bind_port << std::endl;
+            close_socket (sock);
+            sock = -1;
+            return;
+        }
+
+        set_nonblocking (sock);
+        enable_rx_timestamps (sock);
+        for (int port : peer_ports)
+            find_or_add (make_dest_addr (peer_ip, port));
+    }
+
+    ~MultipathLink () override
+    {
+        if (sock >= 0)
+            close_socket (sock);
+    }
+
+    MultipathLink (const MultipathLink&) = delete;
+    MultipathLink& operator = (const MultipathLink&) = delete;
+
+    int fd () const override { return sock; }
+
+    const std::vector<PathStats>& path_stats () const { return paths; }
+
+    ssize_t send_data (const PacketHeader& header,
+                       std::span<const byte_t> payload) override
+    {
+        if (paths.empty ())
+            return -1;
+
+        // A forward notice reuses the id of a packet still in flight but
+        // is not that packet: send it on the best path, outside the
+        // striping and loss accounting
+        if (header.flags & (byte_t) PacketFlag::Forward)
+        {
+            auto best = std::max_element (paths.begin (), paths.end (),
+                                          [] (const PathStats& lhs,
+                                              const PathStats& rhs)
+                                          { return lhs.weight ()
+                                                 < rhs.weight (); });
+            return send_data_view (sock, header, payload, best->addr);
+        }
+
+        // Resent before acked: the last copy was lost on its path
+        auto it = in_flight.find (header.id);
+        if (it != in_flight.end ())
+        {
+            PathStats& lost_on = paths[it->second];
+            ++lost_on.lost;
+            lost_on.loss += gain * (1.0 - lost_on.loss);
+        }
+
+        size_t path = pick ();
+        in_flight[header.id] = path;
+        ++paths[path].sent;
+
+        return send_data_view (sock, header, payload, paths[path].addr);
+    }
+
+    ssize_t send_ack (const AckPacket& ack) override
+    {
+        if (paths.empty ())
+            return -1;
+
+        return ::send_ack (sock, ack, paths[reply_path].addr);
+    }
+
+    ssize_t receive (UnionPacket& packet, ns_t& arrival_ns) override
+    {
+        sockaddr_in from {};
+        ssize_t ret = receive_packet (sock, packet, &from, &arrival_ns);
+        if (ret < 1)
+            return ret;
+
+        if (packet.ack_packet.header.type == PacketType::Data)
+        {
+            reply_path = find_or_add (from);
+            return ret;
+        }
+
+        // Selective ack samples rtt, cumulative ones just credit paths
+        const AckPacket& ack = packet.ack_packet;
+        on_acked (ack.header.id, arrival_ns - ack.header.send_ns);
+
+        for (auto flight = in_flight.begin (); flight != in_flight.end (); )
+        {
+            auto next = std::next (flight);
+            if (id_before (flight->first, ack.cumulative))
+                on_acked (flight->first, 0);
+
+            flight = next;
+        }
+
+        return ret;
+    }
+};
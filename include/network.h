@@ -6,25 +6,56 @@
 #pragma once
 
 #include "packet.h"
+#include "helpers.h"
+#include "shm.h"
 #include <arpa/inet.h>
+#include <algorithm>
+#include <endian.h>
+#include <fcntl.h>
+#include <cstddef>
 #include <cstring>
 #include <iostream>
 #include <unistd.h>
 #include <poll.h>
-#include <set>
+#include <sys/uio.h>
+#include <ctime>
+#include <span>
+#include <vector>
 
 /**
- * Create a UDP socket. Returns fd or -1 on failure.
+ * Create a UDP socket, or a shared-memory endpoint once
+ * use_shm_transport () is on. Returns fd or -1 on failure.
  */
 inline int create_udp_socket ()
 {
-    int sock = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    int sock = -1;
+    if (ShmTransport::enabled)
+    {
+        auto endpoint = std::make_unique<ShmEndpoint> ();
+        sock = endpoint->fd ();
+        if (sock >= 0)
+            ShmTransport::endpoints[sock] = std::move (endpoint);
+    }
+    else
+        sock = socket (AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
     if (sock < 0)
         std::cerr << "Could not acquire socket" << std::endl;
 
     return sock;
 }
 
+/**
+ * Close a socket from create_udp_socket ()
+ */
+inline void close_socket (int sock)
+{
+    if (ShmTransport::find (sock) != nullptr)
+        ShmTransport::endpoints.erase (sock);   // closes it
+    else
+        ::close (sock);
+}
+
 /**
  * Build a sockaddr_in bound to INADDR_ANY on the given port.
  */
@@ -51,100 +82,281 @@ inline sockaddr_in make_dest_addr (const char* ip, int port)
     return dest;
 }
 
+/**
+ * Key identifying an address and port, for flow lookup
+ */
+inline uint64_t address_key (const sockaddr_in& addr)
+{
+    return ((uint64_t) addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
 /**
  * Bind a socket. Returns 0 on success.
  */
 inline int bind_socket (int sock, int port)
 {
+    if (ShmEndpoint* shm = ShmTransport::find (sock))
+        return shm->bind (port);
+
     sockaddr_in addr = make_bind_addr (port);
     return bind (sock, (sockaddr*) &addr, sizeof (addr));
 }
 
+/**
+ * Make socket operations non-blocking. Returns 0 on success.
+ */
+inline int set_nonblocking (int sock)
+{
+    int flags = fcntl (sock, F_GETFL, 0);
+    if (flags < 0)
+        return flags;
+
+    return fcntl (sock, F_SETFL, flags | O_NONBLOCK);
+}
+
+/**
+ * Have the kernel stamp each datagram's arrival. Returns 0 on success.
+ */
+inline int enable_rx_timestamps (int sock)
+{
+    // Shared-memory packets carry their own stamp
+    if (ShmTransport::find (sock) != nullptr)
+        return 0;
+
+    int on = 1;
+    return setsockopt (sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof (on));
+}
+
+/**
+ * recvfrom that also reports when the datagram reached the host, on the
+ * get_time_ns () clock: the kernel stamp if enabled, else now. Excludes
+ * the time the packet sat in the socket before this call.
+ */
+inline ssize_t receive_stamped (int sock, void* buffer, size_t len,
+                                int flags, sockaddr_in* from,
+                                ns_t* arrival_ns)
+{
+    if (ShmEndpoint* shm = ShmTransport::find (sock))
+        return shm->receive (buffer, len, from, arrival_ns);
+
+    iovec iov {.iov_base = buffer, .iov_len = len};
+    alignas (cmsghdr) char control[CMSG_SPACE (sizeof (timespec))];
+
+    msghdr msg {};
+    msg.msg_name = from;
+    msg.msg_namelen = from ? sizeof (sockaddr_in) : 0;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+
+    ssize_t ret = recvmsg (sock, &msg, flags);
+    if (ret < 0 || arrival_ns == nullptr)
+        return ret;
+
+    *arrival_ns = get_time_ns ();
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR (&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR (&msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+            continue;
+
+        // Kernel stamps are wall clock, so shift by the packet's age
+        timespec stamp;
+        timespec wall;
+        memcpy (&stamp, CMSG_DATA (cmsg), sizeof (stamp));
+        clock_gettime (CLOCK_REALTIME, &wall);
+
+        ns_t age = (wall.tv_sec - stamp.tv_sec) * 1000000000LL
+                 + (wall.tv_nsec - stamp.tv_nsec);
+        *arrival_ns -= std::max (age, ns_t {0});
+    }
+
+    return ret;
+}
+
+/**
+ * Receive a packet of either type without blocking.
+ * Returns bytes read, < 1 if none available.
+ * Stores the sender's address in from and its arrival time in
+ * arrival_ns, if given.
+ */
+inline ssize_t receive_packet (int sock, UnionPacket& packet,
+                               sockaddr_in* from = nullptr,
+                               ns_t* arrival_ns = nullptr)
+{
+    ssize_t ret = receive_stamped (sock, &packet, sizeof (UnionPacket),
+                                   MSG_DONTWAIT, from, arrival_ns);
+    if (ret < (ssize_t) sizeof (PacketHeader))
+        return -1;
+
+    PacketHeader& header = packet.ack_packet.header;
+    header.id = ntohl (header.id);
+    header.send_ns = be64toh (header.send_ns);
+
+    if (header.type == PacketType::Ack)
+    {
+        packet.ack_packet.cumulative = ntohl (packet.ack_packet.cumulative);
+        packet.ack_packet.window = ntohl (packet.ack_packet.window);
+    }
+
+    // Never trust byte_count past what actually arrived
+    if (header.type == PacketType::Data)
+        packet.data_packet.byte_count = std::min<size_t> (
+            ntohl (packet.data_packet.byte_count),
+            ret - std::min<size_t> (ret, offsetof (DataPacket, payload)));
+
+    return ret;
+}
+
 /**
  * Receive a data packet. Returns bytes read, or < 1 on failure.
+ * Stores the sender's address in from and its arrival time in
+ * arrival_ns, if given.
  */
-inline ssize_t receive_data (int sock, DataPacket& packet)
+inline ssize_t receive_data (int sock, DataPacket& packet,
+                             sockaddr_in* from = nullptr,
+                             ns_t* arrival_ns = nullptr)
 {
-    packet = {};
-    ssize_t ret = recv (sock, &packet, sizeof (DataPacket), 0);
-    
+    // Only the received bytes are written, nothing is zeroed up front
+    ssize_t ret = receive_stamped (sock, &packet, sizeof (DataPacket), 0,
+                                   from, arrival_ns);
+    if (ret < (ssize_t) offsetof (DataPacket, payload))
+        return -1;
+
     packet.header.id = ntohl (packet.header.id);
-    packet.byte_count = ntohl (packet.byte_count);
+    packet.header.send_ns = be64toh (packet.header.send_ns);
+    packet.byte_count = std::min<size_t> (ntohl (packet.byte_count),
+                                          ret - offsetof (DataPacket,
+                                                          payload));
 
     return ret;
 }
 
 /**
- * Send a data packet to a destination. Returns sendto result.
- * Adjusts packet endianness
+ * Send a data header with a payload living elsewhere (e.g. a file
+ * mapping), gathered by the kernel without copying into a DataPacket.
+ * Returns sendmsg result. Adjusts header endianness.
  */
-inline ssize_t send_data (int sock, const DataPacket& packet,
-                          const sockaddr_in& dest)
+inline ssize_t send_data_view (int sock, const PacketHeader& header,
+                               std::span<const byte_t> payload,
+                               const sockaddr_in& dest)
 {
-    DataPacket out_packet {.header = {.type = PacketType::Data,
-                                      .id = htonl (packet.header.id)},
-                           .byte_count = htonl (packet.byte_count)};
-    memcpy (out_packet.payload.begin (), packet.payload.begin (),
-            packet.byte_count);
+    // Same layout as the front of DataPacket
+    struct
+    {
+        PacketHeader header;
+        size_t byte_count;
+    } wire {.header = {.type = PacketType::Data,
+                       .flags = header.flags,
+                       .id = htonl (header.id),
+                       .send_ns = (ns_t) htobe64 (header.send_ns)},
+            .byte_count = htonl (payload.size ())};
 
-    // Only send size assigned of full allocation
-    size_t len = sizeof (packet.header.id) + sizeof (packet.byte_count)
-                                           + packet.byte_count;
+    static_assert (sizeof (wire) == offsetof (DataPacket, payload));
 
-    return sendto (sock, &out_packet, len, 0,
-                   (const sockaddr*) &dest, sizeof (dest));
+    iovec iov[2] = {{.iov_base = &wire, .iov_len = sizeof (wire)},
+                    {.iov_base = (void*) payload.data (),
+                     .iov_len = payload.size ()}};
+
+    if (ShmEndpoint* shm = ShmTransport::find (sock))
+        return shm->send (iov, 2, dest);
+
+    msghdr msg {};
+    msg.msg_name = (void*) &dest;
+    msg.msg_namelen = sizeof (dest);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    return sendmsg (sock, &msg, 0);
+}
+
+/**
+ * Send a data packet to a destination. Returns sendmsg result.
+ * Only the assigned part of the payload is sent.
+ */
+inline ssize_t send_data (int sock, const DataPacket& packet,
+                          const sockaddr_in& dest)
+{
+    return send_data_view (sock, packet.header,
+                           {packet.payload.data (), packet.byte_count}, dest);
 }
 
 /**
  * Receive an ack packet. Returns bytes read, < 1 on failure or timeout.
+ * Stores the sender's address in from and its arrival time in
+ * arrival_ns, if given.
  */
-inline ssize_t receive_ack (int sock, AckPacket& packet, ms_t ack_timeout)
+inline ssize_t receive_ack (int sock, AckPacket& packet, ms_t ack_timeout,
+                            sockaddr_in* from = nullptr,
+                            ns_t* arrival_ns = nullptr)
 {
     packet = {};
 
     // Set up timeout
     pollfd pollfds[1] = {{.fd = sock, .events = POLLIN}};
     
-    // Wait on socket until data available or timeout
-    int ready = poll (pollfds, 1, (int) ack_timeout);
+    // Shared memory only wakes a reader that found its rings empty
+    ssize_t ret = -1;
+    if (ShmTransport::find (sock) != nullptr)
+        ret = receive_stamped (sock, &packet, sizeof (AckPacket), 0,
+                               from, arrival_ns);
+
+    if (ret < 0)
+    {
+        // Wait on socket until data available or timeout
+        int ready = poll (pollfds, 1, (int) ack_timeout);
     
-    if (ready < 1)
-        return -1;  // Error or timeout
+        if (ready < 1)
+            return -1;  // Error or timeout
     
-    // Get data
-    ssize_t ret = recv (sock, &packet, sizeof (AckPacket), 0);
+        // Get data
+        ret = receive_stamped (sock, &packet, sizeof (AckPacket), 0,
+                               from, arrival_ns);
+    }
+
     if (ret > 0)
+    {
         packet.header.id = ntohl (packet.header.id);
+        packet.header.send_ns = be64toh (packet.header.send_ns);
+        packet.cumulative = ntohl (packet.cumulative);
+        packet.window = ntohl (packet.window);
+    }
 
     return ret;
 }
 
 /**
- * Receive all acks
+ * Receive all acks, including their echoed send timestamps
  */
-inline std::set<id_t> receive_all_acks (int sock, ms_t ack_timeout)
+inline std::vector<AckPacket> receive_all_acks (int sock, ms_t ack_timeout)
 {
-    std::set<id_t> ack_ids;
+    std::vector<AckPacket> acks;
 
     pollfd pollfds[1] = {{.fd = sock, .events = POLLIN}};
     int ready = poll (pollfds, 1, (int)ack_timeout);
 
     if (ready < 1)
-        return ack_ids;  // empty set
+        return acks;  // empty
 
     while (true)
     {
         AckPacket packet{};
-        ssize_t ret = recv (sock, &packet, sizeof (AckPacket), MSG_DONTWAIT);
+        ssize_t ret = receive_stamped (sock, &packet, sizeof (AckPacket),
+                                       MSG_DONTWAIT, nullptr, nullptr);
 
         if (ret <= 0)
             break;  // nothing left in buffer
 
         packet.header.id = ntohl (packet.header.id);
-        ack_ids.insert (packet.header.id);
+        packet.header.send_ns = be64toh (packet.header.send_ns);
+        packet.cumulative = ntohl (packet.cumulative);
+        packet.window = ntohl (packet.window);
+        acks.push_back (packet);
     }
 
-    return ack_ids;
+    return acks;
 }
 
 /*
@@ -154,7 +366,18 @@ inline ssize_t send_ack (int sock, const AckPacket& packet,
                          const sockaddr_in& dest)
 {
     AckPacket out_packet {.header = {.type = PacketType::Ack,
-                                     .id = htonl (packet.header.id)}};
+                                     .flags = packet.header.flags,
+                                     .id = htonl (packet.header.id),
+                                     .send_ns = (ns_t) htobe64 (
+                                         packet.header.send_ns)},
+                           .cumulative = htonl (packet.cumulative),
+                           .window = htonl (packet.window)};
+
+    if (ShmEndpoint* shm = ShmTransport::find (sock))
+    {
+        iovec iov {.iov_base = &out_packet, .iov_len = sizeof (AckPacket)};
+        return shm->send (&iov, 1, dest);
+    }
     
     return sendto (sock, &out_packet, sizeof (AckPacket), 0,
                    (const sockaddr*) &dest, sizeof (dest));
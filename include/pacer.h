@@ -54,6 +54,15 @@ public:
         return true;
     }
 
+    /**
+     * Change the average rate, keeping tokens already earned
+     */
+    void set_rate (double new_rate)
+    {
+        refill ();
+        rate = new_rate;
+    }
+
     /**
      * Get number of tokens available
      */
@@ -19,18 +19,52 @@ enum class PacketType : byte_t
     Ack     = 1,
 };
 
+/**
+ * Bit flags in the packet header
+ */
+enum class PacketFlag : byte_t
+{
+    None    = 0,
+    Fin     = 1 << 0,   // Last packet of a transfer, payload is FinPayload
+    Ect     = 1 << 1,   // Data: sender reacts to congestion marks
+    Ce      = 1 << 2,   // Data: congestion experienced, set by a queue
+    Ece     = 1 << 3,   // Ack: a marked packet arrived since the last ack
+    Forward = 1 << 4,   // Data: no payload, the sender gave up on every
+                        // id before this one
+    Frag    = 1 << 5,   // Data: payload starts with a FragmentHeader
+    FragEnd = 1 << 6,   // Data: final fragment of its message
+    Bundle  = 1 << 7,   // Data: several small messages, see bundle_field_t
+};
+
+/**
+ * Serial number arithmetic (RFC 1982) on wire ids. Streams count packets
+ * in 64 bits and carry the low 32 on the wire, so ids compare correctly
+ * across the wrap while within 2^31 packets of each other.
+ */
+inline int32_t id_distance (id_t id, id_t reference)
+{
+    return (int32_t) (id - reference);
+}
+
+inline bool id_before (id_t lhs, id_t rhs)
+{
+    return id_distance (lhs, rhs) < 0;
+}
+
 /**
  * Header all packets share
  */
 struct PacketHeader
 {
     PacketType type;
+    byte_t flags;
     id_t id;
+    ns_t send_ns;       // Sender transmit time, echoed back in acks
 
     bool operator < (const PacketHeader& rhs) const
     {
-        return this->id < rhs.id;
-    } 
+        return id_before (this->id, rhs.id);
+    }
 };
 
 /**
@@ -39,6 +73,8 @@ struct PacketHeader
 struct AckPacket
 {
     PacketHeader header;
+    id_t cumulative;    // every id before this has been received
+    id_t window;        // packets from cumulative on the sender may send
 };
 
 /**
@@ -48,7 +84,7 @@ struct DataPacket
 {
     PacketHeader header;
     size_t byte_count;
-    std::array<byte_t, MAX_PAYLOAD_BYTE_COUNT> payload = {};
+    std::array<byte_t, MAX_PAYLOAD_BYTE_COUNT> payload;
 
     bool operator < (const DataPacket& rhs) const
     {
@@ -56,6 +92,33 @@ struct DataPacket
     }
 };
 
+/**
+ * Payload of the FIN packet ending a transfer, big-endian on the wire
+ */
+struct FinPayload
+{
+    uint64_t total_bytes;
+    uint64_t checksum;      // checksum64 over all transfer bytes
+};
+
+/**
+ * Front of a fragment's payload, placing it in its message. Big-endian
+ * on the wire.
+ */
+struct FragmentHeader
+{
+    uint32_t message_id;
+    uint32_t length;        // whole message, bytes
+    uint32_t offset;        // of this fragment's data in the message
+};
+
+/**
+ * A bundle's payload is its messages back to back, then the length of
+ * each and finally their count, as big-endian bundle_field_t. Readers of
+ * the byte stream stop before the lengths.
+ */
+using bundle_field_t = uint16_t;
+
 /**
  * Union of packets
  */
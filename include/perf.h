@@ -0,0 +1,264 @@
+/**
+ * @file perf.h
+ * @brief Hardware performance counters through perf_event_open
+ */
+
+#pragma once
+
+#include "types.h"
+#include <array>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/**
+ * Counters read together as one group
+ */
+enum class Counter : byte_t
+{
+    Cycles          = 0,
+    Instructions    = 1,
+    CacheMisses     = 2,
+    BranchMisses    = 3,
+};
+
+inline constexpr size_t counter_count = 4;
+
+inline const char* counter_name (Counter counter)
+{
+    switch (counter)
+    {
+        case Counter::Cycles:       return "cycles";
+        case Counter::Instructions: return "instructions";
+        case Counter::CacheMisses:  return "cache_misses";
+        case Counter::BranchMisses: return "branch_misses";
+    }
+
+    return "unknown";
+}
+
+/**
+ * One reading of every counter
+ */
+struct CounterValues
+{
+    std::array<uint64_t, counter_count> values {};
+
+    uint64_t operator [] (Counter counter) const
+    {
+        return values[(size_t) counter];
+    }
+
+    CounterValues operator - (const CounterValues& rhs) const
+    {
+        CounterValues out;
+        for (size_t ind = 0; ind < counter_count; ++ind)
+            out.values[ind] = values[ind] - rhs.values[ind];
+        return out;
+    }
+
+    CounterValues& operator += (const CounterValues& rhs)
+    {
+        for (size_t ind = 0; ind < counter_count; ++ind)
+            values[ind] += rhs.values[ind];
+        return *this;
+    }
+};
+
+/**
+ * User-space hardware counters for the calling thread, counting from
+ * construction. Counters the kernel refuses read as zero, and the whole
+ * group is inert without a PMU or under a strict perf_event_paranoid,
+ * as in most containers.
+ */
+class PerfCounters
+{
+private:
+    std::array<int, counter_count> fds {-1, -1, -1, -1};
+
+    // Position of each counter in a group read, -1 if not open
+    std::array<int, counter_count> slots {-1, -1, -1, -1};
+    size_t open_count = 0;
+
+    static int open_counter (uint64_t config, int group_fd)
+    {
+        perf_event_attr attr {};
+        attr.size = sizeof (attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = config;
+        attr.disabled = group_fd < 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP;
+
+        return (int) syscall (SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+    }
+
+public:
+    PerfCounters ()
+    {
+        constexpr std::array<uint64_t, counter_count> configs {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+        // Cycles lead the group, without them nothing is opened
+        for (size_t ind = 0; ind < counter_count; ++ind)
+        {
+            fds[ind] = open_counter (configs[ind], fds[0]);
+            if (fds[ind] < 0)
+            {
+                if (ind == 0)
+                    return;
+                continue;
+            }
+
+            slots[ind] = (int) open_count++;
+        }
+
+        ioctl (fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl (fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    ~PerfCounters ()
+    {
+        for (int fd : fds)
+            if (fd >= 0)
+                ::close (fd);
+    }
+
+    PerfCounters (const PerfCounters&) = delete;
+    PerfCounters& operator = (const PerfCounters&) = delete;
+
+    bool is_open () const { return fds[0] >= 0; }
+
+    /**
+     * Counts so far, all zero if inert. One syscall.
+     */
+    CounterValues read () const
+    {
+        CounterValues out;
+        if (!is_open ())
+            return out;
+
+        // PERF_FORMAT_GROUP layout: count, then one value per member
+        uint64_t buffer[1 + counter_count] = {};
+        ssize_t got = ::read (fds[0], buffer, sizeof (buffer));
+        if (got < (ssize_t) sizeof (uint64_t))
+            return out;
+
+        for (size_t ind = 0; ind < counter_count; ++ind)
+            if (slots[ind] >= 0 && (uint64_t) slots[ind] < buffer[0])
+                out.values[ind] = buffer[1 + slots[ind]];
+
+        return out;
+    }
+};
+
+/**
+ * Hot sections a SectionProfiler attributes counts to
+ */
+enum class Section : byte_t
+{
+    Hazard      = 0,    // hazard effects for a packet
+    Queue       = 1,    // delay and bottleneck queue operations
+    Send        = 2,    // handing a packet to the transport
+    Receive     = 3,    // taking a packet from the transport
+    Reorder     = 4,    // buffering and in-order delivery
+    Display     = 5,    // terminal rendering
+};
+
+inline constexpr size_t section_count = 6;
+
+inline const char* section_name (Section section)
+{
+    switch (section)
+    {
+        case Section::Hazard:   return "hazard";
+        case Section::Queue:    return "queue";
+        case Section::Send:     return "send";
+        case Section::Receive:  return "receive";
+        case Section::Reorder:  return "reorder";
+        case Section::Display:  return "display";
+    }
+
+    return "unknown";
+}
+
+/**
+ * Running totals of one section
+ */
+struct SectionTotals
+{
+    size_t calls = 0;
+    CounterValues counters {};
+};
+
+/**
+ * Totals counters per named section of one thread. Each section entry
+ * and exit reads the group, one syscall each, so this is opt-in. Calls
+ * are still counted when the counters are unavailable.
+ */
+class SectionProfiler
+{
+private:
+    PerfCounters counters;
+    std::array<SectionTotals, section_count> sections {};
+
+public:
+    bool is_open () const { return counters.is_open (); }
+
+    CounterValues read () const { return counters.read (); }
+
+    void add (Section section, const CounterValues& delta)
+    {
+        SectionTotals& totals = sections[(size_t) section];
+        ++totals.calls;
+        totals.counters += delta;
+    }
+
+    const SectionTotals& totals (Section section) const
+    {
+        return sections[(size_t) section];
+    }
+};
+
+/**
+ * Attributes the counts between construction and destruction to a
+ * section. Does nothing without a profiler.
+ */
+class SectionScope
+{
+private:
+    SectionProfiler* profiler;
+    Section section;
+    CounterValues start {};
+
+public:
+    SectionScope (SectionProfiler* profiler, Section section)
+        : profiler (profiler), section (section)
+    {
+        if (profiler != nullptr)
+            start = profiler->read ();
+    }
+
+    ~SectionScope ()
+    {
+        if (profiler != nullptr)
+            profiler->add (section, profiler->read () - start);
+    }
+
+    SectionScope (const SectionScope&) = delete;
+    SectionScope& operator = (const SectionScope&) = delete;
+};
+
+/**
+ * Run fn as a section and return its result
+ */
+template <typename Fn>
+auto profiled (SectionProfiler* profiler, Section section, Fn&& fn)
+{
+    SectionScope scope (profiler, section);
+    return fn ();
+}
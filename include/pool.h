@@ -0,0 +1,166 @@
+/**
+ * @file pool.h
+ * @brief Work-stealing thread pool for independent jobs
+ */
+
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Fixed set of workers, each with its own job deque. A worker takes from
+ * the back of its own deque and, once that runs dry, steals from the
+ * front of the others, so jobs of very uneven length still keep every
+ * core busy. Jobs must not throw.
+ */
+class WorkStealingPool
+{
+public:
+    using Job = std::function<void ()>;
+
+private:
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+
+    std::mutex state_mutex;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    size_t pending = 0;             // submitted, not yet finished
+    std::atomic<size_t> queued {0}; // submitted, not yet taken
+    size_t next_worker = 0;
+    bool stopping = false;
+
+    /**
+     * Pop own work first, else steal the oldest job of another worker
+     */
+    bool take (size_t self, Job& job)
+    {
+        for (size_t offset = 0; offset < workers.size (); ++offset)
+        {
+            Worker& worker = *workers[(self + offset) % workers.size ()];
+            std::lock_guard<std::mutex> lock (worker.mutex);
+            if (worker.jobs.empty ())
+                continue;
+
+            if (offset == 0)
+            {
+                job = std::move (worker.jobs.back ());
+                worker.jobs.pop_back ();
+            }
+            else
+            {
+                job = std::move (worker.jobs.front ());
+                worker.jobs.pop_front ();
+            }
+
+            --queued;
+            return true;
+        }
+
+        return false;
+    }
+
+    void run (size_t self)
+    {
+        while (true)
+        {
+            Job job;
+            if (take (self, job))
+            {
+                job ();
+
+                std::lock_guard<std::mutex> lock (state_mutex);
+                if (--pending == 0)
+                    idle.notify_all ();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock (state_mutex);
+            wake.wait (lock, [&] { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+
+public:
+    /**
+     * Start thread_count workers, one per hardware thread if 0
+     */
+    explicit WorkStealingPool (size_t thread_count = 0)
+    {
+        if (thread_count == 0)
+            thread_count = std::max (1u, std::thread::hardware_concurrency ());
+
+        for (size_t ind = 0; ind < thread_count; ++ind)
+            workers.push_back (std::make_unique<Worker> ());
+
+        for (size_t ind = 0; ind < thread_count; ++ind)
+            threads.emplace_back ([this, ind] { run (ind); });
+    }
+
+    WorkStealingPool (const WorkStealingPool&) = delete;
+    WorkStealingPool& operator = (const WorkStealingPool&) = delete;
+
+    /**
+     * Finishes queued jobs, then joins
+     */
+    ~WorkStealingPool ()
+    {
+        {
+            std::lock_guard<std::mutex> lock (state_mutex);
+            stopping = true;
+        }
+
+        wake.notify_all ();
+        for (std::thread& thread : threads)
+            thread.join ();
+    }
+
+    size_t size () const { return threads.size (); }
+
+    /**
+     * Queue a job, spreading submissions across workers
+     */
+    void submit (Job job)
+    {
+        // Counted before it is visible, so queued never underflows
+        size_t target;
+        {
+            std::lock_guard<std::mutex> lock (state_mutex);
+            ++pending;
+            ++queued;
+            target = next_worker++ % workers.size ();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (workers[target]->mutex);
+            workers[target]->jobs.push_back (std::move (job));
+        }
+
+        wake.notify_one ();
+    }
+
+    /**
+     * Block until every submitted job has finished
+     */
+    void wait ()
+    {
+        std::unique_lock<std::mutex> lock (state_mutex);
+        idle.wait (lock, [&] { return pending == 0; });
+    }
+};
@@ -0,0 +1,263 @@
+/**
+ * @file reorder.h
+ * @brief Receiver-side reordering of data packets into a contiguous stream
+ */
+
+#pragma once
+
+#include "packet.h"
+#include "buffer.h"
+#include "ring.h"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <memory>
+
+/**
+ * Data packet held for reordering, sized to its payload, with its
+ * arrival time and full sequence number. A fragment whose data was
+ * written straight into its message holds only its headers, and placed
+ * says how much data went there.
+ */
+struct BufferedPacket
+{
+    PacketRef packet;
+    ns_t arrival_ns;
+    seq_t seq;
+    uint32_t placed = 0;
+};
+
+/**
+ * Holds out-of-order packets until the gap before them fills, then moves
+ * them, in order, to a ready queue the application drains. Holds at most
+ * capacity packets, ready or not, so packets too far ahead are refused.
+ * Out-of-order packets sit in a ring indexed by sequence number that
+ * doubles to reach the furthest one, up to capacity, so neither queue
+ * allocates once warm.
+ */
+class ReorderBuffer
+{
+public:
+    static constexpr size_t default_capacity = 2048;
+
+private:
+    PacketPool pool {};
+    std::unique_ptr<BufferedPacket[]> pending {};
+    size_t pending_slots = 0;
+    size_t pending_count = 0;
+    RingDeque<BufferedPacket> ready {};
+    seq_t next_seq;
+    size_t capacity;
+
+    BufferedPacket& pending_at (seq_t seq) const
+    {
+        return pending[seq & (pending_slots - 1)];
+    }
+
+    void grow_pending (size_t min_slots)
+    {
+        size_t old_slots = pending_slots;
+        auto old = std::move (pending);
+        // Never past capacity, which fits () already holds packets to
+        pending_slots = std::min (std::bit_ceil (std::max<size_t> (
+                                      {min_slots, old_slots * 2, 64})),
+                                  std::bit_ceil (capacity));
+        pending = std::make_unique<BufferedPacket[]> (pending_slots);
+        for (size_t ind = 0; ind < old_slots; ++ind)
+            if (old[ind].packet)
+                pending_at (old[ind].seq) = std::move (old[ind]);
+    }
+
+public:
+    explicit ReorderBuffer (seq_t first = 0,
+                            size_t capacity = default_capacity)
+        : next_seq (first), capacity (std::max<size_t> (capacity, 1)) {}
+
+    ReorderBuffer (const ReorderBuffer&) = delete;
+    ReorderBuffer& operator = (const ReorderBuffer&) = delete;
+
+    /**
+     * Packets from expected () on that there is room for: the receive
+     * window to advertise
+     */
+    size_t window () const
+    {
+        return capacity - std::min (capacity, ready.size ());
+    }
+
+    /**
+     * False if a packet lies past the window, old ids fit
+     */
+    bool fits (id_t id) const
+    {
+        return id_distance (id, (id_t) next_seq) < (int64_t) window ();
+    }
+
+    /**
+     * Copy of a received packet into the pool the buffer holds packets
+     * in, for insert ()
+     */
+    PacketRef store (const DataPacket& packet)
+    {
+        return pool.store (packet);
+    }
+
+    PacketRef store (const PacketHeader& header,
+                     std::span<const byte_t> payload)
+    {
+        return pool.store (header, payload);
+    }
+
+    /**
+     * True if insert () would keep a packet with this id: it fits and is
+     * neither delivered nor held already
+     */
+    bool wants (id_t id) const
+    {
+        int32_t ahead = id_distance (id, (id_t) next_seq);
+        if (ahead < 0 || !fits (id))
+            return false;
+
+        return (size_t) ahead >= pending_slots
+            || !pending_at (next_seq + (seq_t) ahead).packet;
+    }
+
+    /**
+     * Buffer a packet, returns false for duplicates and packets that do
+     * not fit. The wire id is widened relative to the next expected
+     * sequence number. Takes the packet over without copying.
+     */
+    bool insert (PacketRef packet, ns_t arrival_ns, uint32_t placed = 0)
+    {
+        id_t id = packet.header ().id;
+        if (!wants (id))
+            return false;
+
+        int32_t ahead = id_distance (id, (id_t) next_seq);
+        if ((size_t) ahead >= pending_slots)
+            grow_pending ((size_t) ahead + 1);
+
+        seq_t seq = next_seq + (seq_t) ahead;
+        pending_at (seq) = {.packet = std::move (packet),
+                            .arrival_ns = arrival_ns, .seq = seq,
+                            .placed = placed};
+        ++pending_count;
+        return true;
+    }
+
+    /**
+     * As above, copying the packet into the pool if it is kept
+     */
+    bool insert (const DataPacket& packet, ns_t arrival_ns)
+    {
+        if (id_distance (packet.header.id, (id_t) next_seq) < 0
+            || !fits (packet.header.id))
+            return false;
+
+        return insert (pool.store (packet), arrival_ns);
+    }
+
+    /**
+     * Release packets that became contiguous, calling on_ready for each in
+     * order. Packets for which on_ready returns true join the ready queue,
+     * the rest (control packets) are discarded. Returns number released.
+     */
+    template <typename OnReady>
+    size_t advance (OnReady&& on_ready)
+    {
+        size_t released = 0;
+        while (pending_count > 0)
+        {
+            BufferedPacket& slot = pending_at (next_seq);
+            if (!slot.packet)
+                break;
+
+            BufferedPacket packet = std::move (slot);
+            --pending_count;
+            if (on_ready (packet))
+                ready.push_back (std::move (packet));
+
+            ++next_seq;
+            ++released;
+        }
+
+        return released;
+    }
+
+    /**
+     * Give up on every packet before id. Those held are released as by
+     * advance (), the missing ones are passed over. Returns the number
+     * passed over, 0 for an id at or before expected ().
+     */
+    template <typename OnReady>
+    size_t skip_to (id_t id, OnReady&& on_ready)
+    {
+        int32_t ahead = id_distance (id, (id_t) next_seq);
+        if (ahead <= 0)
+            return 0;
+
+        seq_t target = next_seq + (seq_t) ahead;
+        size_t skipped = 0;
+        while (next_seq < target)
+        {
+            if (advance (on_ready) > 0)
+                continue;
+
+            if (pending_count == 0)
+            {
+                skipped += target - next_seq;
+                next_seq = target;
+                break;
+            }
+
+            ++skipped;
+            ++next_seq;
+        }
+
+        advance (on_ready);
+        return skipped;
+    }
+
+    /**
+     * Next in-order packet, nullptr if none ready
+     */
+    const BufferedPacket* front () const
+    {
+        return ready.empty () ? nullptr : &ready.front ();
+    }
+
+    /**
+     * Ready packet index places behind the front, nullptr past the end.
+     * Stays valid while packets ahead of it are popped, but not across
+     * advance (), which may grow the ready queue.
+     */
+    const BufferedPacket* at (size_t index) const
+    {
+        return index < ready.size () ? &ready[index] : nullptr;
+    }
+
+    /**
+     * Packets held behind a missing one. Exact right after advance ().
+     */
+    bool has_gap () const { return pending_count > 0; }
+
+    /**
+     * Packets ready for the application
+     */
+    size_t ready_size () const { return ready.size (); }
+
+    /**
+     * Release the front packet
+     */
+    void pop () { ready.pop_front (); }
+
+    /**
+     * Packets held, out-of-order and ready
+     */
+    size_t size () const { return pending_count + ready.size (); }
+
+    /**
+     * Next sequence number expected in order
+     */
+    seq_t expected () const { return next_seq; }
+};
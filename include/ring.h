@@ -0,0 +1,181 @@
+/**
+ * @file ring.h
+ * @brief Lock-free single-producer/single-consumer ring buffer, and a
+ *        growable single-threaded ring
+ */
+
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <memory>
+#include <span>
+
+/**
+ * Bounded SPSC ring. One thread pushes, one thread reads in batches.
+ * Capacity is rounded up to a power of two.
+ */
+template <typename T>
+class SpscRing
+{
+private:
+    size_t capacity;
+    size_t mask;
+    std::unique_ptr<T[]> slots;
+
+    // Producer and consumer indices on separate cache lines
+    alignas (64) std::atomic<size_t> head {0};
+    size_t cached_tail = 0;
+    alignas (64) std::atomic<size_t> tail {0};
+    size_t cached_head = 0;
+
+public:
+    explicit SpscRing (size_t min_capacity)
+        : capacity (std::bit_ceil (min_capacity)), mask (capacity - 1),
+          slots (std::make_unique<T[]> (capacity)) {}
+
+    SpscRing (const SpscRing&) = delete;
+    SpscRing& operator = (const SpscRing&) = delete;
+
+    /**
+     * Producer: returns false if full
+     */
+    bool try_push (const T& item)
+    {
+        size_t h = head.load (std::memory_order_relaxed);
+        if (h - cached_tail == capacity)
+        {
+            cached_tail = tail.load (std::memory_order_acquire);
+            if (h - cached_tail == capacity)
+                return false;
+        }
+
+        slots[h & mask] = item;
+        head.store (h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Producer: slot to fill in place, published by commit_push (),
+     * nullptr if full. Saves a copy for large items.
+     */
+    T* try_reserve ()
+    {
+        size_t h = head.load (std::memory_order_relaxed);
+        if (h - cached_tail == capacity)
+        {
+            cached_tail = tail.load (std::memory_order_acquire);
+            if (h - cached_tail == capacity)
+                return nullptr;
+        }
+
+        return &slots[h & mask];
+    }
+
+    /**
+     * Producer: publish the slot from try_reserve ()
+     */
+    void commit_push ()
+    {
+        head.store (head.load (std::memory_order_relaxed) + 1,
+                    std::memory_order_release);
+    }
+
+    /**
+     * Consumer: contiguous run of readable items, may be shorter than
+     * size () when the run wraps
+     */
+    std::span<T> acquire_read ()
+    {
+        size_t t = tail.load (std::memory_order_relaxed);
+        if (t == cached_head)
+            cached_head = head.load (std::memory_order_acquire);
+
+        size_t available = cached_head - t;
+        size_t until_wrap = capacity - (t & mask);
+
+        return {&slots[t & mask], std::min (available, until_wrap)};
+    }
+
+    /**
+     * Consumer: hand n items from acquire_read back to the producer
+     */
+    void release_read (size_t n)
+    {
+        tail.store (tail.load (std::memory_order_relaxed) + n,
+                    std::memory_order_release);
+    }
+
+    /**
+     * Approximate occupancy, exact when called from either side while
+     * the other is idle
+     */
+    size_t size () const
+    {
+        return head.load (std::memory_order_acquire)
+             - tail.load (std::memory_order_acquire);
+    }
+
+    size_t max_size () const { return capacity; }
+};
+
+/**
+ * Single-threaded FIFO on a power-of-two ring that doubles when full,
+ * so a queue that stays under its high-water mark never allocates.
+ * Popped slots are reset to T {}, releasing what they held.
+ */
+template <typename T>
+class RingDeque
+{
+private:
+    std::unique_ptr<T[]> slots {};
+    size_t capacity = 0;
+    size_t head = 0;
+    size_t count = 0;
+
+    T& slot (size_t index) const
+    {
+        return slots[(head + index) & (capacity - 1)];
+    }
+
+    void grow ()
+    {
+        size_t bigger = std::max<size_t> (capacity * 2, 16);
+        auto moved = std::make_unique<T[]> (bigger);
+        for (size_t ind = 0; ind < count; ++ind)
+            moved[ind] = std::move (slot (ind));
+
+        slots = std::move (moved);
+        capacity = bigger;
+        head = 0;
+    }
+
+public:
+    RingDeque () = default;
+    RingDeque (const RingDeque&) = delete;
+    RingDeque& operator = (const RingDeque&) = delete;
+
+    void push_back (T&& item)
+    {
+        if (count == capacity)
+            grow ();
+
+        slot (count++) = std::move (item);
+    }
+
+    void pop_front ()
+    {
+        slot (0) = T {};
+        head = (head + 1) & (capacity - 1);
+        --count;
+    }
+
+    T& front () { return slot (0); }
+    const T& front () const { return slot (0); }
+    const T& operator [] (size_t index) const { return slot (index); }
+
+    bool empty () const { return count == 0; }
+    size_t size () const { return count; }
+};
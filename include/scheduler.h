@@ -0,0 +1,106 @@
+/**
+ * @file scheduler.h
+ * @brief Fair queuing across flows sharing a link
+ */
+
+#pragma once
+
+#include "types.h"
+#include <deque>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/**
+ * Deficit round robin over per-flow FIFOs. Each backlogged flow may send
+ * up to quantum bytes per turn, carrying unused credit to its next turn,
+ * so flows share the link by bytes regardless of their packet sizes.
+ * quantum should be at least the largest packet.
+ */
+template <typename Item>
+class DrrScheduler
+{
+private:
+    struct Entry
+    {
+        Item item;
+        size_t bytes;
+    };
+
+    struct FlowQueue
+    {
+        std::deque<Entry> entries;
+        size_t deficit = 0;
+        bool has_turn = false;
+    };
+
+    std::vector<FlowQueue> flows;
+    std::deque<size_t> active;      // backlogged flows in round-robin order
+    size_t quantum;
+    size_t total = 0;
+
+public:
+    explicit DrrScheduler (size_t flow_count, size_t quantum = 1500)
+        : flows (flow_count), quantum (quantum) {}
+
+    /**
+     * Queue an item of a flow
+     */
+    void enqueue (size_t flow, Item item, size_t bytes)
+    {
+        FlowQueue& queue = flows[flow];
+        if (queue.entries.empty ())
+            active.push_back (flow);
+
+        queue.entries.push_back ({.item = std::move (item), .bytes = bytes});
+        ++total;
+    }
+
+    /**
+     * Next item to put on the link, with its flow
+     */
+    std::optional<std::pair<size_t, Item>> dequeue ()
+    {
+        while (!active.empty ())
+        {
+            size_t flow = active.front ();
+            FlowQueue& queue = flows[flow];
+
+            if (!queue.has_turn)
+            {
+                queue.deficit += quantum;
+                queue.has_turn = true;
+            }
+
+            Entry& head = queue.entries.front ();
+            if (head.bytes <= queue.deficit)
+            {
+                queue.deficit -= head.bytes;
+                std::pair<size_t, Item> out {flow, std::move (head.item)};
+                queue.entries.pop_front ();
+                --total;
+
+                // Idle flows keep no credit
+                if (queue.entries.empty ())
+                {
+                    queue.deficit = 0;
+                    queue.has_turn = false;
+                    active.pop_front ();
+                }
+
+                return out;
+            }
+
+            // Out of credit, turn passes to the next flow
+            queue.has_turn = false;
+            active.pop_front ();
+            active.push_back (flow);
+        }
+
+        return std::nullopt;
+    }
+
+    size_t size () const { return total; }
+    size_t size (size_t flow) const { return flows[flow].entries.size (); }
+    bool empty () const { return total == 0; }
+};
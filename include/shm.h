@@ -0,0 +1,481 @@
+/**
+ * @file shm.h
+ * @brief Shared-memory datagram transport between processes on one host
+ */
+
+#pragma once
+
+#include "types.h"
+#include "packet.h"
+#include "helpers.h"
+#include <arpa/inet.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * Control block at the start of a shared ring. Indices are free running.
+ */
+struct ShmRingHeader
+{
+    static constexpr uint64_t expected_magic = 0x50414345524D454DULL;
+
+    uint64_t magic;
+    uint32_t capacity;      // slots, a power of two
+
+    alignas (64) std::atomic<uint64_t> head;            // sender writes
+    alignas (64) std::atomic<uint64_t> tail;            // receiver writes
+    alignas (64) std::atomic<uint32_t> reader_waiting;  // wake on push
+
+    static_assert (std::atomic<uint64_t>::is_always_lock_free,
+                   "shared rings need address-free atomics");
+};
+
+/**
+ * One datagram in a shared ring, stamped when it was pushed
+ */
+struct ShmSlot
+{
+    uint32_t len;
+    ns_t stamp_ns;
+    byte_t bytes[sizeof (UnionPacket)];
+};
+
+/**
+ * Single-producer/single-consumer ring of datagrams from one port to
+ * another, in a POSIX shared memory object the sender creates. The
+ * receiver maps it once it hears of it, and the sender unlinks the
+ * name when done.
+ */
+class ShmChannel
+{
+private:
+    ShmRingHeader* header = nullptr;
+    ShmSlot* slots = nullptr;
+    size_t map_bytes = 0;
+    std::string name;
+    bool owner = false;
+
+    // This process's side of the ring
+    uint64_t cached_head = 0;
+    uint64_t cached_tail = 0;
+
+    static size_t bytes_for (uint32_t capacity)
+    {
+        return sizeof (ShmRingHeader) + capacity * sizeof (ShmSlot);
+    }
+
+    bool map (int fd, size_t len)
+    {
+        void* base = mmap (nullptr, len, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+            return false;
+
+        header = (ShmRingHeader*) base;
+        slots = (ShmSlot*) ((byte_t*) base + sizeof (ShmRingHeader));
+        map_bytes = len;
+        return true;
+    }
+
+public:
+    static constexpr uint32_t default_capacity = 1024;
+
+    bool announced = false;     // sender: receiver told about the ring
+
+    static std::string name_for (int src_port, int dst_port)
+    {
+        return "/pacer-" + std::to_string (src_port) + "-"
+             + std::to_string (dst_port);
+    }
+
+    ShmChannel () = default;
+
+    ~ShmChannel ()
+    {
+        if (header != nullptr)
+            munmap (header, map_bytes);
+        if (owner)
+            shm_unlink (name.c_str ());
+    }
+
+    ShmChannel (const ShmChannel&) = delete;
+    ShmChannel& operator = (const ShmChannel&) = delete;
+
+    /**
+     * Sender side: a fresh ring, replacing any left by an earlier run.
+     * nullptr on failure.
+     */
+    static std::unique_ptr<ShmChannel> create (
+        int src_port, int dst_port, uint32_t capacity = default_capacity)
+    {
+        auto channel = std::make_unique<ShmChannel> ();
+        channel->name = name_for (src_port, dst_port);
+        capacity = std::bit_ceil (capacity);
+
+        shm_unlink (channel->name.c_str ());
+        int fd = shm_open (channel->name.c_str (),
+                           O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            return nullptr;
+
+        channel->owner = true;
+        size_t len = bytes_for (capacity);
+        bool mapped = ftruncate (fd, (off_t) len) == 0
+                   && channel->map (fd, len);
+        ::close (fd);
+        if (!mapped)
+            return nullptr;
+
+        ShmRingHeader* header = new (channel->header) ShmRingHeader {};
+        header->capacity = capacity;
+        header->magic = ShmRingHeader::expected_magic;
+        return channel;
+    }
+
+    /**
+     * Receiver side: map the ring a sender created. nullptr if there is
+     * none or it is not a ring.
+     */
+    static std::unique_ptr<ShmChannel> open (int src_port, int dst_port)
+    {
+        auto channel = std::make_unique<ShmChannel> ();
+        channel->name = name_for (src_port, dst_port);
+
+        int fd = shm_open (channel->name.c_str (), O_RDWR, 0600);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat info {};
+        bool mapped = fstat (fd, &info) == 0
+                   && (size_t) info.st_size >= sizeof (ShmRingHeader)
+                   && channel->map (fd, (size_t) info.st_size);
+        ::close (fd);
+        if (!mapped
+            || channel->header->magic != ShmRingHeader::expected_magic
+            || bytes_for (channel->header->capacity) > channel->map_bytes)
+            return nullptr;
+
+        channel->cached_head = channel->header->tail.load ();
+        return channel;
+    }
+
+    /**
+     * Sender: copy a gathered datagram into the next slot, truncated to
+     * a slot. Returns its length, or -1 if the ring is full. Returns
+     * true in wake if the receiver asked to be woken.
+     */
+    ssize_t push (const iovec* iov, size_t count, bool& wake)
+    {
+        uint64_t capacity = header->capacity;
+        uint64_t h = header->head.load (std::memory_order_relaxed);
+        if (h - cached_tail == capacity)
+        {
+            cached_tail = header->tail.load (std::memory_order_acquire);
+            if (h - cached_tail == capacity)
+                return -1;
+        }
+
+        ShmSlot& slot = slots[h & (capacity - 1)];
+        size_t len = 0;
+        for (size_t ind = 0; ind < count; ++ind)
+        {
+            size_t part = std::min (iov[ind].iov_len,
+                                    sizeof (slot.bytes) - len);
+            memcpy (slot.bytes + len, iov[ind].iov_base, part);
+            len += part;
+        }
+
+        slot.len = (uint32_t) len;
+        slot.stamp_ns = get_time_ns ();
+
+        // Publish before reading the flag, pairs with sleep ()
+        header->head.store (h + 1, std::memory_order_seq_cst);
+        wake = header->reader_waiting.load (std::memory_order_seq_cst) != 0
+            && header->reader_waiting.exchange (0) != 0;
+
+        return (ssize_t) len;
+    }
+
+    /**
+     * Receiver: move the oldest datagram into buffer, truncating if
+     * short. Returns bytes copied, or -1 if empty.
+     */
+    ssize_t pop (void* buffer, size_t len, ns_t* stamp_ns)
+    {
+        uint64_t t = header->tail.load (std::memory_order_relaxed);
+        if (t == cached_head)
+        {
+            cached_head = header->head.load (std::memory_order_acquire);
+            if (t == cached_head)
+                return -1;
+        }
+
+        const ShmSlot& slot = slots[t & (header->capacity - 1)];
+        size_t copied = std::min<size_t> (slot.len, len);
+        memcpy (buffer, slot.bytes, copied);
+        if (stamp_ns != nullptr)
+            *stamp_ns = slot.stamp_ns;
+
+        header->tail.store (t + 1, std::memory_order_release);
+        return (ssize_t) copied;
+    }
+
+    /**
+     * Receiver: ask to be woken by the next push. Check the ring again
+     * afterwards, a push may have raced with this.
+     */
+    void sleep ()
+    {
+        header->reader_waiting.store (1, std::memory_order_seq_cst);
+    }
+};
+
+/**
+ * Stands in for a UDP socket bound to a port: one ShmChannel to each
+ * port it sends to and from each port that sends to it.
+ *
+ * The descriptor handed out is a Unix datagram socket in the abstract
+ * namespace, named for the port, that is only used as a doorbell. It
+ * polls readable when a sender opens a new ring to this port, or pushes
+ * to a ring whose reader found it empty. A busy reader is never woken,
+ * so packets flow without system calls. Readers must receive until
+ * empty before polling again, as Connection and the emulator do.
+ */
+class ShmEndpoint
+{
+private:
+    /**
+     * Doorbell datagram
+     */
+    struct Bell
+    {
+        int32_t src_port;
+        uint32_t announce;      // new ring, map it
+    };
+
+    int bell = -1;
+    int port = 0;
+    std::unordered_map<int, std::unique_ptr<ShmChannel>> outgoing {};
+    std::vector<std::pair<int, std::unique_ptr<ShmChannel>>> incoming {};
+    size_t next_incoming = 0;
+
+    static sockaddr_un bell_addr (int port, socklen_t& len)
+    {
+        sockaddr_un addr {};
+        addr.sun_family = AF_UNIX;
+        int name_len = std::snprintf (addr.sun_path + 1,
+                                      sizeof (addr.sun_path) - 1,
+                                      "pacer-%d", port);
+        len = (socklen_t) (offsetof (sockaddr_un, sun_path) + 1 + name_len);
+        return addr;
+    }
+
+    bool ring (int dst_port, bool announce)
+    {
+        Bell message {.src_port = port, .announce = announce};
+        socklen_t len = 0;
+        sockaddr_un addr = bell_addr (dst_port, len);
+
+        return sendto (bell, &message, sizeof (message), MSG_DONTWAIT,
+                       (const sockaddr*) &addr, len) == sizeof (message);
+    }
+
+    /**
+     * Consume pending doorbells, mapping newly announced rings
+     */
+    void answer_bells ()
+    {
+        Bell message {};
+        while (recv (bell, &message, sizeof (message), MSG_DONTWAIT)
+               == sizeof (message))
+        {
+            if (!message.announce)
+                continue;
+
+            auto channel = ShmChannel::open (message.src_port, port);
+            if (!channel)
+                continue;
+
+            auto it = std::find_if (incoming.begin (), incoming.end (),
+                                    [&] (const auto& entry)
+                                    { return entry.first
+                                          == message.src_port; });
+
+            // A restarted sender replaces its old ring
+            if (it != incoming.end ())
+                it->second = std::move (channel);
+            else
+                incoming.emplace_back (message.src_port,
+                                       std::move (channel));
+        }
+    }
+
+    ssize_t pop_any (void* buffer, size_t len, sockaddr_in* from,
+                     ns_t* arrival_ns)
+    {
+        for (size_t count = 0; count < incoming.size (); ++count)
+        {
+            auto& [src_port, channel] = incoming[next_incoming];
+            next_incoming = (next_incoming + 1) % incoming.size ();
+
+            ssize_t ret = channel->pop (buffer, len, arrival_ns);
+            if (ret < 0)
+                continue;
+
+            if (from != nullptr)
+            {
+                *from = {};
+                from->sin_family = AF_INET;
+                from->sin_port = htons ((uint16_t) src_port);
+                from->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+            }
+
+            return ret;
+        }
+
+        return -1;
+    }
+
+public:
+    ShmEndpoint ()
+    {
+        bell = socket (AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    }
+
+    ~ShmEndpoint ()
+    {
+        if (bell >= 0)
+            ::close (bell);
+    }
+
+    ShmEndpoint (const ShmEndpoint&) = delete;
+    ShmEndpoint& operator = (const ShmEndpoint&) = delete;
+
+    int fd () const { return bell; }
+
+    /**
+     * Take a port. Returns 0 on success, -1 if it is taken.
+     */
+    int bind (int bind_port)
+    {
+        socklen_t len = 0;
+        sockaddr_un addr = bell_addr (bind_port, len);
+        if (::bind (bell, (const sockaddr*) &addr, len) < 0)
+            return -1;
+
+        port = bind_port;
+        return 0;
+    }
+
+    /**
+     * Send a gathered datagram to dest's port. Returns its length, or -1
+     * with errno set: EAGAIN if the peer's ring is full.
+     */
+    ssize_t send (const iovec* iov, size_t count, const sockaddr_in& dest)
+    {
+        if (port == 0)
+        {
+            errno = EDESTADDRREQ;
+            return -1;
+        }
+
+        int dst_port = ntohs (dest.sin_port);
+        std::unique_ptr<ShmChannel>& channel = outgoing[dst_port];
+        if (!channel && !(channel = ShmChannel::create (port, dst_port)))
+        {
+            outgoing.erase (dst_port);
+            return -1;
+        }
+
+        // Until the receiver is up, packets wait in the ring
+        if (!channel->announced)
+            channel->announced = ring (dst_port, true);
+
+        bool wake = false;
+        ssize_t ret = channel->push (iov, count, wake);
+        if (ret < 0)
+        {
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if (wake)
+            ring (dst_port, false);
+
+        return ret;
+    }
+
+    /**
+     * Next datagram from any sender, round robin. Returns bytes copied,
+     * or -1 with errno EAGAIN if none. Never blocks.
+     */
+    ssize_t receive (void* buffer, size_t len, sockaddr_in* from,
+                     ns_t* arrival_ns)
+    {
+        ssize_t ret = pop_any (buffer, len, from, arrival_ns);
+        if (ret >= 0)
+            return ret;
+
+        // Empty: pick up new rings, ask for a wakeup, then look again in
+        // case a push raced with the request
+        answer_bells ();
+        for (auto& [src_port, channel] : incoming)
+            channel->sleep ();
+
+        ret = pop_any (buffer, len, from, arrival_ns);
+        if (ret < 0)
+            errno = EAGAIN;
+
+        return ret;
+    }
+};
+
+/**
+ * Process-wide switch to shared memory and the endpoints standing in
+ * for sockets, by descriptor. Set up from one thread.
+ */
+struct ShmTransport
+{
+    static inline bool enabled = false;
+    static inline std::unordered_map<int, std::unique_ptr<ShmEndpoint>>
+        endpoints {};
+
+    /**
+     * Endpoint behind a descriptor, nullptr for real sockets
+     */
+    static ShmEndpoint* find (int fd)
+    {
+        if (!enabled)
+            return nullptr;
+
+        auto it = endpoints.find (fd);
+        return it == endpoints.end () ? nullptr : it->second.get ();
+    }
+};
+
+/**
+ * Make create_udp_socket () hand out shared-memory endpoints from now
+ * on. Every process of a run must agree.
+ */
+inline void use_shm_transport ()
+{
+    ShmTransport::enabled = true;
+}
@@ -0,0 +1,79 @@
+/**
+ * @file simulation.h
+ * @brief Discrete-event simulation of a transfer in virtual time
+ */
+
+#pragma once
+
+#include "types.h"
+#include "metrics.h"
+#include <optional>
+#include <string>
+#include <vector>
+
+/**
+ * Hazard and its constructor arguments, defaults where omitted
+ */
+struct HazardSpec
+{
+    std::string name;
+    std::vector<double> params {};
+};
+
+/**
+ * One simulated sender -> hazards -> receiver transfer
+ */
+struct SimConfig
+{
+    size_t packets = (2 << 10);
+    size_t payload_size = 1024;
+
+    // Token bucket pacing, unshaped when rate is unset
+    std::optional<double> pacing_rate = std::nullopt;
+    double pacing_burst = 5;
+
+    ms_t retransmit_timeout = 100;
+    size_t window_size = 10;
+    seq_t initial_sequence = 0;
+
+    // Receiver ack policy, see ConnectionConfig
+    size_t ack_every = 2;
+    ms_t ack_delay = 10;
+
+    // Sender loop: poll for acks up to ack_wait, then sleep for tick
+    ms_t ack_wait = 50;
+    ms_t tick = 100;
+
+    // One-way base delay, added to hazard delays in each direction
+    ms_t propagation = 0;
+
+    // Applied in order to every packet in both directions, like the
+    // emulator: dropped if any drops, delays add up
+    std::vector<HazardSpec> hazards {};
+
+    unsigned int seed = 0;
+
+    // Give up after this much simulated time
+    ms_t time_limit = 7 * 24 * 3600 * 1000;
+};
+
+/**
+ * Outcome of a simulated transfer
+ */
+struct SimResult
+{
+    bool completed;
+    bool verified;
+    ns_t sim_ns;                // simulated duration
+    double wall_sec;            // real time taken to simulate
+    size_t dropped;
+    SenderMetrics sender;
+    ReceiverMetrics receiver;
+};
+
+/**
+ * Run a transfer to completion against a virtual clock. No sockets, no
+ * sleeps, deterministic for a given config and seed. Thread-safe: the
+ * virtual clock is per thread.
+ */
+SimResult run_simulation (const SimConfig& config);
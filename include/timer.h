@@ -0,0 +1,94 @@
+/**
+ * @file timer.h
+ * @brief Pollable one-shot timer on the get_time_ns () clock
+ */
+
+#pragma once
+
+#include "types.h"
+#include <algorithm>
+#include <sys/prctl.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+/**
+ * A timerfd that polls readable once its deadline passes. Deadlines are
+ * absolute get_time_ns () values; the steady clock is CLOCK_MONOTONIC on
+ * Linux. Re-arming for an unchanged deadline costs nothing. Inert if the
+ * timerfd cannot be created.
+ */
+class DeadlineTimer
+{
+private:
+    int timer_fd = -1;
+    ns_t armed_ns = 0;      // 0 when disarmed
+
+    void set (ns_t deadline_ns)
+    {
+        itimerspec spec {};
+        spec.it_value.tv_sec = deadline_ns / 1000000000;
+        spec.it_value.tv_nsec = deadline_ns % 1000000000;
+        timerfd_settime (timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+        armed_ns = deadline_ns;
+    }
+
+public:
+    DeadlineTimer ()
+    {
+        timer_fd = timerfd_create (CLOCK_MONOTONIC,
+                                   TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+
+    ~DeadlineTimer ()
+    {
+        if (timer_fd >= 0)
+            ::close (timer_fd);
+    }
+
+    DeadlineTimer (const DeadlineTimer&) = delete;
+    DeadlineTimer& operator = (const DeadlineTimer&) = delete;
+
+    bool is_open () const { return timer_fd >= 0; }
+    int fd () const { return timer_fd; }
+
+    /**
+     * Armed deadline, 0 when disarmed
+     */
+    ns_t deadline () const { return armed_ns; }
+
+    /**
+     * Fire at deadline_ns, replacing any earlier deadline. Past
+     * deadlines fire at once.
+     */
+    void arm (ns_t deadline_ns)
+    {
+        if (timer_fd >= 0 && deadline_ns != armed_ns)
+            set (std::max<ns_t> (deadline_ns, 1));
+    }
+
+    void disarm ()
+    {
+        if (timer_fd >= 0 && armed_ns != 0)
+            set (0);
+    }
+
+    /**
+     * Acknowledge a firing so the fd stops polling readable
+     */
+    void clear ()
+    {
+        uint64_t expirations = 0;
+        if (timer_fd >= 0 && ::read (timer_fd, &expirations,
+                                     sizeof (expirations)) > 0)
+            armed_ns = 0;
+    }
+};
+
+/**
+ * Let this thread's timers fire within slack_ns of their deadline
+ * instead of the default 50 us
+ */
+inline void set_timer_slack (ns_t slack_ns)
+{
+    prctl (PR_SET_TIMERSLACK, (unsigned long) slack_ns, 0, 0, 0);
+}
@@ -0,0 +1,248 @@
+/**
+ * @file trace.h
+ * @brief Binary per-packet event trace
+ */
+
+#pragma once
+
+#include "types.h"
+#include "helpers.h"
+#include "ring.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <thread>
+
+/**
+ * Packet events recorded by the stages
+ */
+enum class EventType : byte_t
+{
+    Transmit    = 0,
+    Retransmit  = 1,
+    SendFail    = 2,
+    Acked       = 3,
+    Received    = 4,
+    Duplicate   = 5,
+    AckFail     = 6,
+    Delivered   = 7,
+    Dropped     = 8,    // arg: PacketType
+    Queued      = 9,    // arg: delay ms
+    FwdData     = 10,
+    FwdAck      = 11,
+    Abandoned   = 12,   // expired unacked, or skipped by the receiver
+};
+
+/**
+ * Process that recorded an event
+ */
+enum class Stage : byte_t
+{
+    Sender      = 0,
+    Emulator    = 1,
+    Receiver    = 2,
+};
+
+/**
+ * Fixed-size trace record, written to disk as-is
+ */
+struct TraceEvent
+{
+    ns_t time_ns;
+    id_t id;
+    uint32_t arg;
+    EventType type;
+    Stage stage;
+    byte_t reserved[6];
+};
+
+static_assert (sizeof (TraceEvent) == 24, "trace record layout changed");
+
+/**
+ * Trace file header
+ */
+struct TraceFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+static constexpr char TRACE_MAGIC[8] = {'P', 'A', 'C', 'E', 'R', 'T', 'R', 'C'};
+static constexpr uint32_t TRACE_VERSION = 1;
+
+/**
+ * Printable event name
+ */
+inline const char* event_name (EventType type)
+{
+    switch (type)
+    {
+        case EventType::Transmit:   return "Transmit";
+        case EventType::Retransmit: return "Retransmit";
+        case EventType::SendFail:   return "Send fail";
+        case EventType::Acked:      return "Acked";
+        case EventType::Received:   return "Received";
+        case EventType::Duplicate:  return "Duplicate";
+        case EventType::AckFail:    return "Ack fail";
+        case EventType::Delivered:  return "Delivered";
+        case EventType::Dropped:    return "Dropped";
+        case EventType::Queued:     return "Queued";
+        case EventType::FwdData:    return "Fwd Data";
+        case EventType::FwdAck:     return "Fwd Ack";
+        case EventType::Abandoned:  return "Abandoned";
+    }
+
+    return "Unknown";
+}
+
+/**
+ * Printable stage name
+ */
+inline const char* stage_name (Stage stage)
+{
+    switch (stage)
+    {
+        case Stage::Sender:     return "sender";
+        case Stage::Emulator:   return "emulator";
+        case Stage::Receiver:   return "receiver";
+    }
+
+    return "unknown";
+}
+
+/**
+ * Human-readable line for an event, e.g. "Transmit   ID 12"
+ */
+inline std::string format_event (const TraceEvent& event)
+{
+    char buf[64];
+    int len = std::snprintf (buf, sizeof (buf), "%-10s ID %u",
+                             event_name (event.type), (unsigned) event.id);
+
+    if (event.type == EventType::Dropped)
+        std::snprintf (buf + len, sizeof (buf) - len, " (%s)",
+                       event.arg == 0 ? "data" : "ack");
+    else if (event.type == EventType::Queued)
+        std::snprintf (buf + len, sizeof (buf) - len, " (+%ums)", event.arg);
+
+    return buf;
+}
+
+/**
+ * Timestamped event
+ */
+inline TraceEvent make_event (Stage stage, EventType type, id_t id,
+                              uint32_t arg = 0)
+{
+    return TraceEvent {.time_ns = get_time_ns (), .id = id, .arg = arg,
+                       .type = type, .stage = stage};
+}
+
+/**
+ * Records events into a lock-free ring, drained to a trace file by a
+ * background thread. Inert if no path is given. Events are dropped, and
+ * counted, if the writer falls a full ring behind.
+ */
+class Tracer
+{
+private:
+    static constexpr size_t ring_capacity = 1 << 16;
+
+    Stage stage;
+    FILE* file = nullptr;
+    std::unique_ptr<SpscRing<TraceEvent>> ring;
+    std::thread writer;
+    std::atomic<bool> running {false};
+    size_t dropped = 0;
+
+    /**
+     * Writer thread: drain ring to file until stopped
+     */
+    void drain ()
+    {
+        while (true)
+        {
+            bool stopping = !running.load (std::memory_order_acquire);
+
+            size_t written = 0;
+            std::span<TraceEvent> batch;
+            while (!(batch = ring->acquire_read ()).empty ())
+            {
+                std::fwrite (batch.data (), sizeof (TraceEvent),
+                             batch.size (), file);
+                ring->release_read (batch.size ());
+                written += batch.size ();
+            }
+
+            if (written > 0)
+                std::fflush (file);
+
+            if (stopping)
+                return;
+
+            if (written == 0)
+                std::this_thread::sleep_for (std::chrono::milliseconds (5));
+        }
+    }
+
+public:
+    Tracer (const char* path, Stage stage) : stage (stage)
+    {
+        if (path == nullptr)
+            return;
+
+        file = std::fopen (path, "wb");
+        if (file == nullptr)
+        {
+            std::cerr << "Could not open trace file " << path << std::endl;
+            return;
+        }
+
+        TraceFileHeader header {.version = TRACE_VERSION,
+                                .record_size = sizeof (TraceEvent)};
+        std::copy (std::begin (TRACE_MAGIC), std::end (TRACE_MAGIC),
+                   header.magic);
+        std::fwrite (&header, sizeof (header), 1, file);
+
+        ring = std::make_unique<SpscRing<TraceEvent>> (ring_capacity);
+        running.store (true, std::memory_order_release);
+        writer = std::thread (&Tracer::drain, this);
+    }
+
+    ~Tracer ()
+    {
+        if (file == nullptr)
+            return;
+
+        running.store (false, std::memory_order_release);
+        writer.join ();
+        std::fclose (file);
+    }
+
+    Tracer (const Tracer&) = delete;
+    Tracer& operator = (const Tracer&) = delete;
+
+    bool is_open () const { return file != nullptr; }
+    size_t dropped_events () const { return dropped; }
+
+    /**
+     * Build a timestamped event for this stage
+     */
+    TraceEvent make (EventType type, id_t id, uint32_t arg = 0) const
+    {
+        return make_event (stage, type, id, arg);
+    }
+
+    /**
+     * Hot path: one ring push, no allocation
+     */
+    void record (const TraceEvent& event)
+    {
+        if (ring && !ring->try_push (event))
+            ++dropped;
+    }
+};
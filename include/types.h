@@ -7,7 +7,8 @@
 
 #include <cstdint>
 
-using id_t      = uint32_t;
+using id_t      = uint32_t;     // packet id on the wire
+using seq_t     = uint64_t;     // full stream sequence number
 using size_t    = uint64_t;
 using byte_t    = uint8_t;
 
@@ -0,0 +1,141 @@
+/**
+ * @file window.h
+ * @brief Sender-side sliding window of in-flight packets
+ */
+
+#pragma once
+
+#include "packet.h"
+#include <algorithm>
+#include <span>
+#include <vector>
+
+/**
+ * Header of an in-flight packet, payload is owned by the caller
+ */
+struct WindowSlot
+{
+    PacketHeader header;
+    std::span<const byte_t> payload;
+    bool ack;
+    size_t transmissions;
+    ns_t expire_ns;     // abandoned if unacked by then, 0 never
+};
+
+/**
+ * Handler for packet window
+ */
+class Window
+{
+public:
+    static constexpr size_t default_size = 10;
+
+    // <packet, ack received>
+    std::vector<WindowSlot> out_buffer;
+
+    // number of slots populated
+    size_t n = 0;
+
+    explicit Window (size_t max_size = default_size)
+        : out_buffer (std::max<size_t> (max_size, 1)) {}
+
+    size_t max_size () const { return out_buffer.size (); }
+
+    /**
+     * Move start of the internal buffer to out_buffer and update n
+     * Returns number of slots opened
+     */
+    size_t try_shift ()
+    {
+        size_t ind = 0;
+        while (ind < n && out_buffer[ind].ack)
+            ++ind;
+
+        std::move
+        (
+            out_buffer.begin () + ind,
+            out_buffer.end (),
+            out_buffer.begin ()
+        );
+
+        n -= ind;
+        return ind;
+    }
+
+    /**
+     * Returns false if add unsuccessful
+     */
+    bool add (const PacketHeader& header, std::span<const byte_t> payload,
+              ns_t expire_ns = 0)
+    {
+        if (n == max_size ())
+            return false;
+
+        out_buffer[n++] = WindowSlot {.header = header,
+                                      .payload = payload,
+                                      .ack = false,
+                                      .transmissions = 0,
+                                      .expire_ns = expire_ns};
+        return true;
+    }
+
+    /**
+     * Set one packet as acknowledged, returns true if it was unacked.
+     * Wire ids are unique within any window smaller than 2^32.
+     */
+    bool set_ack (id_t id)
+    {
+        for (size_t ind = 0; ind < n; ++ind)
+        {
+            if (out_buffer[ind].header.id != id)
+                continue;
+
+            bool was_unacked = !out_buffer[ind].ack;
+            out_buffer[ind].ack = true;
+            return was_unacked;
+        }
+
+        return false;
+    }
+
+    /**
+     * Set every packet before a cumulative ack as acknowledged, returns
+     * the number newly acked
+     */
+    size_t set_acks_before (id_t cumulative)
+    {
+        size_t count = 0;
+        for (size_t ind = 0; ind < n; ++ind)
+        {
+            WindowSlot& slot = out_buffer[ind];
+            if (slot.ack || !id_before (slot.header.id, cumulative))
+                continue;
+
+            slot.ack = true;
+            ++count;
+        }
+
+        return count;
+    }
+
+    /**
+     * Set packets as acknowledged
+     */
+    void set_acks (const std::vector<AckPacket>& acks)
+    {
+        for (const AckPacket& ack : acks)
+            set_ack (ack.header.id);
+    }
+
+    /**
+     * Count of unacked packets in window
+     */
+    size_t unacked () const
+    {
+        size_t count = 0;
+        for (size_t ind = 0; ind < n; ++ind)
+            if (!out_buffer[ind].ack)
+                ++count;
+        return count;
+    }
+};
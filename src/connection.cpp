@@ -0,0 +1,1080 @@
+/**
+ * @file connection.cpp
+ * @brief Non-blocking reliable transport over UDP
+ */
+
+#include "connection.h"
+#include "helpers.h"
+#include <cerrno>
+#include <cstring>
+#include <limits>
+
+Connection::Connection (const ConnectionConfig& config)
+    : Connection (config, std::make_unique<UdpLink> (config.bind_port,
+                                                     config.peer_ip,
+                                                     config.peer_port))
+{
+    open = link->fd () >= 0;
+}
+
+Connection::Connection (const ConnectionConfig& config,
+                        std::unique_ptr<PacketLink> link)
+    : config (config), link (std::move (link)), open (true),
+      window (config.window_size), next_send_seq (config.initial_sequence),
+      send_checksum (checksum64 ({})), send_storage (window.max_size ()),
+      cwnd ((double) window.max_size ()),
+      recover_seq (config.initial_sequence),
+      peer_edge (config.initial_sequence + window.max_size ()),
+      abandoned_end (config.initial_sequence),
+      forward_seq (config.initial_sequence),
+      peer_cumulative (config.initial_sequence),
+      reorder (config.initial_sequence, config.receive_window),
+      receive_checksum (checksum64 ({})), advertised (reorder.window ())
+{
+    this->config.payload_size = std::min (config.payload_size,
+                                          MAX_PAYLOAD_BYTE_COUNT);
+
+    if (config.pacing_rate)
+        pacer.emplace (*config.pacing_rate, config.pacing_burst);
+
+    send_metrics.cwnd = congestion_window ();
+    send_metrics.peer_window = window.max_size ();
+}
+
+/**
+ * Deadline lifetime ms from now, 0 for none
+ */
+static ns_t expire_after (ms_t lifetime)
+{
+    return lifetime > 0 ? get_time_ns () + lifetime * 1000000 : 0;
+}
+
+/**
+ * Field i of a bundle's trailer, counting back from its end
+ */
+static size_t bundle_field (std::span<const byte_t> payload, size_t index)
+{
+    bundle_field_t field;
+    memcpy (&field, payload.data () + payload.size ()
+                        - (index + 1) * sizeof (field), sizeof (field));
+    return ntohs (field);
+}
+
+/**
+ * Messages in a bundle, 0 if its trailer does not fit
+ */
+static size_t bundle_count (std::span<const byte_t> payload)
+{
+    if (payload.size () < sizeof (bundle_field_t))
+        return 0;
+
+    size_t count = bundle_field (payload, 0);
+    return (count + 1) * sizeof (bundle_field_t) <= payload.size ()
+         ? count : 0;
+}
+
+/**
+ * Length of a bundle's message index, given a valid count
+ */
+static size_t bundle_length (std::span<const byte_t> payload, size_t count,
+                             size_t index)
+{
+    return bundle_field (payload, count - index);
+}
+
+/**
+ * Application data of a delivered payload, past any fragment header and
+ * before any bundle trailer
+ */
+static std::span<const byte_t> data_of (const PacketHeader& header,
+                                        std::span<const byte_t> payload)
+{
+    if (header.flags & (byte_t) PacketFlag::Bundle)
+        return payload.first (payload.size () - std::min (
+            payload.size (), (bundle_count (payload) + 1)
+                             * sizeof (bundle_field_t)));
+
+    if (!(header.flags & (byte_t) PacketFlag::Frag))
+        return payload;
+
+    return payload.subspan (std::min (payload.size (),
+                                      sizeof (FragmentHeader)));
+}
+
+/**
+ * Fragment header of a data packet. Data sent without one is a message
+ * of its own, numbered after the one in progress.
+ */
+static FragmentHeader fragment_of (const PacketHeader& header,
+                                   std::span<const byte_t> payload,
+                                   uint32_t previous_id)
+{
+    if (!(header.flags & (byte_t) PacketFlag::Frag))
+        return {.message_id = previous_id + 1,
+                .length = (uint32_t) payload.size (), .offset = 0};
+
+    FragmentHeader wire {};
+    memcpy (&wire, payload.data (), std::min (payload.size (),
+                                              sizeof (wire)));
+    return {.message_id = ntohl (wire.message_id),
+            .length = ntohl (wire.length), .offset = ntohl (wire.offset)};
+}
+
+/**
+ * Report an event to the owner
+ */
+void Connection::event (Stage stage, EventType type, id_t id)
+{
+    if (on_event)
+        on_event (make_event (stage, type, id));
+}
+
+/**** SEND SIDE ****/
+
+/**
+ * Add a packet to the window and try to send it right away
+ */
+ssize_t Connection::enqueue (std::span<const byte_t> payload, byte_t flags,
+                             ns_t expire_ns)
+{
+    if (!writable () || fin_queued)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (config.ecn)
+        flags |= (byte_t) PacketFlag::Ect;
+
+    if (next_send_seq >= peer_edge)
+        ++send_metrics.window_probes;
+
+    PacketHeader header {.type = PacketType::Data, .flags = flags,
+                         .id = (id_t) next_send_seq++};
+    window.add (header, payload, expire_ns);
+    transmit (window.out_buffer[window.n - 1]);
+
+    return (ssize_t) payload.size ();
+}
+
+ssize_t Connection::send (std::span<const byte_t> data, ms_t lifetime)
+{
+    if (outgoing.active || !flush_bundle () || !writable ())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    // In-flight sequence numbers are contiguous, so seq % window size
+    // never collides
+    data = data.first (std::min (data.size (), config.payload_size));
+    auto& storage = send_storage[next_send_seq % send_storage.size ()];
+    std::copy (data.begin (), data.end (), storage.begin ());
+
+    return send_ref ({storage.data (), data.size ()}, lifetime);
+}
+
+ssize_t Connection::send_ref (std::span<const byte_t> data, ms_t lifetime)
+{
+    if (outgoing.active || !flush_bundle ())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    data = data.first (std::min (data.size (), config.payload_size));
+
+    ssize_t ret = enqueue (data, (byte_t) PacketFlag::None,
+                           expire_after (lifetime));
+    if (ret >= 0)
+    {
+        send_checksum = checksum64 (data, send_checksum);
+        send_bytes += data.size ();
+    }
+
+    return ret;
+}
+
+ssize_t Connection::send_message (std::span<const byte_t> message,
+                                  ms_t lifetime)
+{
+    if (outgoing.active || fin_queued || message.empty ()
+        || message.size () > std::numeric_limits<uint32_t>::max ())
+    {
+        errno = outgoing.active ? EAGAIN : EINVAL;
+        return -1;
+    }
+
+    // Small messages share packets, anything else goes after them
+    if (config.bundle_delay > 0
+        && message.size () + 2 * sizeof (bundle_field_t)
+           <= config.payload_size)
+        return bundle_message (message, lifetime);
+
+    if (!flush_bundle ())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    outgoing.active = true;
+    outgoing.data = message;
+    outgoing.offset = 0;
+    outgoing.expire_ns = expire_after (lifetime);
+
+    pump_message ();
+    return (ssize_t) message.size ();
+}
+
+/**
+ * Copy fragments of the outgoing message into the window while it has
+ * room, each behind its FragmentHeader in the slot's storage
+ */
+void Connection::pump_message ()
+{
+    size_t room = config.payload_size - std::min (config.payload_size - 1,
+                                                  sizeof (FragmentHeader));
+    while (outgoing.active && writable ())
+    {
+        std::span<const byte_t> data = outgoing.data.subspan (
+            outgoing.offset,
+            std::min (room, outgoing.data.size () - outgoing.offset));
+        bool last = outgoing.offset + data.size () == outgoing.data.size ();
+
+        FragmentHeader fragment {
+            .message_id = htonl (outgoing.message_id),
+            .length = htonl ((uint32_t) outgoing.data.size ()),
+            .offset = htonl ((uint32_t) outgoing.offset)};
+
+        auto& storage = send_storage[next_send_seq % send_storage.size ()];
+        memcpy (storage.data (), &fragment, sizeof (fragment));
+        std::copy (data.begin (), data.end (),
+                   storage.begin () + sizeof (fragment));
+
+        byte_t flags = (byte_t) PacketFlag::Frag;
+        if (last)
+            flags |= (byte_t) PacketFlag::FragEnd;
+
+        if (enqueue ({storage.data (), sizeof (fragment) + data.size ()},
+                     flags, outgoing.expire_ns) < 0)
+            return;
+
+        send_checksum = checksum64 (data, send_checksum);
+        send_bytes += data.size ();
+        outgoing.offset += data.size ();
+
+        if (last)
+        {
+            outgoing.active = false;
+            ++outgoing.message_id;
+            ++send_metrics.messages_sent;
+        }
+    }
+}
+
+/**
+ * Room in the pending bundle for a message of size bytes and its length
+ */
+bool Connection::bundle_fits (size_t size) const
+{
+    return bundle.used + size + (bundle.count + 2) * sizeof (bundle_field_t)
+        <= config.payload_size;
+}
+
+/**
+ * Copy a small message into the pending bundle, first sending the bundle
+ * if it is too full to take it
+ */
+ssize_t Connection::bundle_message (std::span<const byte_t> message,
+                                    ms_t lifetime)
+{
+    if (!bundle_fits (message.size ()) && !flush_bundle ())
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ns_t expire_ns = expire_after (lifetime);
+    if (bundle.count == 0)
+    {
+        bundle.deadline_ns = get_time_ns () + config.bundle_delay * 1000;
+        bundle.expire_ns = expire_ns;
+    }
+    else if (bundle.expire_ns > 0)
+    {
+        bundle.expire_ns = expire_ns > 0 ? std::min (bundle.expire_ns,
+                                                     expire_ns)
+                                         : 0;
+    }
+
+    std::copy (message.begin (), message.end (),
+               bundle.bytes.begin () + bundle.used);
+    bundle.used += message.size ();
+    bundle.lengths[bundle.count++] = (bundle_field_t) message.size ();
+    ++send_metrics.messages_sent;
+
+    // No message fits any more, no point waiting. A full window leaves it
+    // to service ().
+    if (!bundle_fits (1))
+        flush_bundle ();
+
+    return (ssize_t) message.size ();
+}
+
+/**
+ * Send the pending bundle: messages, their lengths, then the count.
+ * Returns false, keeping it, while the window is full.
+ */
+bool Connection::flush_bundle ()
+{
+    if (bundle.count == 0)
+        return true;
+
+    if (!writable () || fin_queued)
+        return false;
+
+    auto& storage = send_storage[next_send_seq % send_storage.size ()];
+    std::copy (bundle.bytes.begin (), bundle.bytes.begin () + bundle.used,
+               storage.begin ());
+
+    size_t size = bundle.used;
+    for (size_t ind = 0; ind < bundle.count; ++ind)
+    {
+        bundle_field_t field = htons (bundle.lengths[ind]);
+        memcpy (storage.data () + size, &field, sizeof (field));
+        size += sizeof (field);
+    }
+
+    bundle_field_t count = htons ((bundle_field_t) bundle.count);
+    memcpy (storage.data () + size, &count, sizeof (count));
+    size += sizeof (count);
+
+    if (enqueue ({storage.data (), size}, (byte_t) PacketFlag::Bundle,
+                 bundle.expire_ns) < 0)
+        return false;
+
+    send_checksum = checksum64 ({bundle.bytes.data (), bundle.used},
+                           send_checksum);
+    send_bytes += bundle.used;
+    ++send_metrics.bundles_sent;
+
+    bundle.used = 0;
+    bundle.count = 0;
+    return true;
+}
+
+bool Connection::finish ()
+{
+    if (fin_queued)
+        return true;
+
+    if (outgoing.active || !flush_bundle ())
+        return false;
+
+    FinPayload fin {.total_bytes = htobe64 (send_bytes),
+                    .checksum = htobe64 (send_checksum)};
+    memcpy (fin_payload.data (), &fin, sizeof (fin));
+
+    if (enqueue (fin_payload, (byte_t) PacketFlag::Fin, 0) < 0)
+        return false;
+
+    fin_queued = true;
+    return true;
+}
+
+/**
+ * Send one window slot if the pacer allows. Returns false if paced out.
+ */
+bool Connection::transmit (WindowSlot& slot)
+{
+    // Rate shaping: hold back if bucket empty
+    if (pacer && !pacer->try_consume ())
+        return false;
+
+    bool is_retransmit = slot.transmissions > 0;
+    slot.header.send_ns = get_time_ns ();
+
+    ssize_t sent = profiled (profiler, Section::Send, [&]
+        { return link->send_data (slot.header, slot.payload); });
+    if (sent < 0)
+    {
+        event (Stage::Sender, EventType::SendFail, slot.header.id);
+        return true;
+    }
+
+    event (Stage::Sender, is_retransmit ? EventType::Retransmit
+                                        : EventType::Transmit,
+           slot.header.id);
+
+    if (!is_retransmit)
+        ++send_metrics.unique_sent;
+
+    ++slot.transmissions;
+    ++send_metrics.total_sent;
+    send_metrics.bytes_sent += slot.payload.size ();
+    return true;
+}
+
+/**
+ * Stop retransmitting packets past their lifetime, and tell the peer to
+ * skip up to the first packet still owed
+ */
+void Connection::abandon_expired (ns_t now)
+{
+    seq_t first_owed = next_send_seq;
+    for (size_t ind = window.n; ind-- > 0;)
+    {
+        WindowSlot& slot = window.out_buffer[ind];
+        if (slot.ack)
+            continue;
+
+        if (slot.expire_ns == 0 || now < slot.expire_ns)
+        {
+            first_owed = widen (slot.header.id);
+            continue;
+        }
+
+        slot.ack = true;
+        abandoned_end = std::max (abandoned_end, widen (slot.header.id) + 1);
+        ++send_metrics.abandoned;
+        event (Stage::Sender, EventType::Abandoned, slot.header.id);
+    }
+
+    // Packets acked in between are held by the peer and released by the
+    // skip, so the notice only has to stop short of owed ones
+    seq_t target = std::min (first_owed, abandoned_end);
+    bool advanced = target > forward_seq;
+    forward_seq = std::max (forward_seq, target);
+
+    ns_t timeout_ns = config.retransmit_timeout * 1000000;
+    if (forward_seq > peer_cumulative
+        && (advanced || now - forward_sent_ns >= timeout_ns))
+        send_forward (now);
+}
+
+/**
+ * Send the forward notice, a payload-less data packet. Like acks it is
+ * not paced or counted as data.
+ */
+void Connection::send_forward (ns_t now)
+{
+    PacketHeader header {.type = PacketType::Data,
+                         .flags = (byte_t) PacketFlag::Forward,
+                         .id = (id_t) forward_seq, .send_ns = now};
+    forward_sent_ns = now;
+
+    ssize_t sent = profiled (profiler, Section::Send,
+                             [&] { return link->send_data (header, {}); });
+    if (sent < 0)
+        event (Stage::Sender, EventType::SendFail, header.id);
+}
+
+/**
+ * Mark a packet acked, sample rtt from the echoed transmit time
+ */
+void Connection::handle_ack (const AckPacket& ack, ns_t now)
+{
+    size_t newly_acked = window.set_ack (ack.header.id)
+                       + window.set_acks_before (ack.cumulative);
+    event (Stage::Sender, EventType::Acked, ack.header.id);
+
+    // Widen the advertised right edge against what has been sent
+    peer_cumulative = std::max (peer_cumulative, widen (ack.cumulative));
+    peer_edge = std::max (peer_edge, widen (ack.cumulative + ack.window));
+    send_metrics.peer_window = ack.window;
+
+    if (config.ecn)
+        on_congestion (ack.header.id, newly_acked,
+                       ack.header.flags & (byte_t) PacketFlag::Ece);
+
+    // Echoed timestamp keeps samples valid for retransmits too
+    if (ack.header.send_ns > 0)
+        send_metrics.rtt.record (now - ack.header.send_ns);
+}
+
+/**
+ * Grow the congestion window by one packet per window acked, or halve
+ * it on a mark echoed by the ack of a packet sent since the last halving
+ */
+void Connection::on_congestion (id_t id, size_t newly_acked, bool marked)
+{
+    double max_cwnd = (double) window.max_size ();
+
+    if (marked && !id_before (id, (id_t) recover_seq))
+    {
+        cwnd = std::max (cwnd / 2, 1.0);
+        recover_seq = next_send_seq;
+        ++send_metrics.ecn_reductions;
+    }
+    else
+    {
+        cwnd = std::min (cwnd + newly_acked / cwnd, max_cwnd);
+    }
+
+    if (pacer)
+        pacer->set_rate (*config.pacing_rate * cwnd / max_cwnd);
+
+    send_metrics.cwnd = congestion_window ();
+}
+
+/**** RECEIVE SIDE ****/
+
+/**
+ * Store a data packet read from the socket. A fragment of the message
+ * recv_message () is filling is copied straight to its place in the
+ * destination, leaving only its headers to buffer for ordering.
+ */
+void Connection::receive_data (const DataPacket& packet, ns_t now)
+{
+    uint32_t placed = place_fragment (packet);
+    if (placed == 0)
+    {
+        handle_data (reorder.store (packet), 0, now);
+        return;
+    }
+
+    std::span<const byte_t> headers (packet.payload.data (),
+                                     sizeof (FragmentHeader));
+    handle_data (reorder.store (packet.header, headers), placed, now);
+}
+
+/**
+ * Copy a new fragment of the message in progress into its destination.
+ * Returns the data bytes placed, 0 if the packet is to be buffered.
+ */
+uint32_t Connection::place_fragment (const DataPacket& packet)
+{
+    const PacketHeader& header = packet.header;
+    size_t byte_count = std::min (packet.byte_count, MAX_PAYLOAD_BYTE_COUNT);
+    byte_t kind = header.flags & ((byte_t) PacketFlag::Frag
+                                  | (byte_t) PacketFlag::Bundle
+                                  | (byte_t) PacketFlag::Forward);
+    if (incoming.destination.empty () || kind != (byte_t) PacketFlag::Frag
+        || byte_count <= sizeof (FragmentHeader) || !reorder.wants (header.id))
+        return 0;
+
+    std::span<const byte_t> payload (packet.payload.data (), byte_count);
+    FragmentHeader fragment = fragment_of (header, payload, 0);
+    std::span<const byte_t> data = payload.subspan (sizeof (FragmentHeader));
+    if (fragment.message_id != incoming.message_id
+        || fragment.offset < incoming.received
+        || fragment.offset + data.size () > incoming.length)
+        return 0;
+
+    std::copy (data.begin (), data.end (),
+               incoming.destination.begin () + fragment.offset);
+    return (uint32_t) data.size ();
+}
+
+/**
+ * Buffer a data packet, deliver what became contiguous, and ack it now
+ * or later depending on the ack policy
+ */
+void Connection::handle_data (PacketRef packet, uint32_t placed, ns_t now)
+{
+    PacketHeader header = packet.header ();
+    size_t byte_count = packet.payload ().size () + placed;
+    id_t id = header.id;
+    last_receive = ns_to_ms (now);
+
+    if (header.flags & (byte_t) PacketFlag::Forward)
+    {
+        handle_forward (header, now);
+        return;
+    }
+
+    if (header.send_ns > 0)
+        receive_metrics.one_way.record (now - header.send_ns);
+
+    ++receive_metrics.total_received;
+
+    bool gap_before = reorder.has_gap ();
+    bool fits = reorder.fits (id);
+    bool fresh = fits && profiled (profiler, Section::Reorder,
+                                   [&] { return reorder.insert (
+                                             std::move (packet), now,
+                                             placed); });
+    if (!fits)
+    {
+        // No room: the ack below tells the sender so
+        ++receive_metrics.refused;
+        event (Stage::Receiver, EventType::Dropped, id);
+    }
+    else if (fresh)
+    {
+        ++receive_metrics.unique_received;
+        receive_metrics.bytes_received += byte_count;
+        event (Stage::Receiver, EventType::Received, id);
+
+        SectionScope scope (profiler, Section::Reorder);
+        reorder.advance ([&] (const BufferedPacket& buffered)
+                         { return on_contiguous (buffered, now); });
+    }
+    else
+    {
+        event (Stage::Receiver, EventType::Duplicate, id);
+    }
+
+    // Echo the newest packet's transmit time. A refused packet is not
+    // acked itself, the ack names the last one in order instead.
+    pending_ack = {.header = {.type = PacketType::Ack,
+                              .id = fits ? id
+                                         : (id_t) (reorder.expected () - 1),
+                              .send_ns = header.send_ns}};
+
+    if (unacked_count++ == 0)
+        ack_deadline = now + config.ack_delay * 1000000;
+
+    bool marked = header.flags & (byte_t) PacketFlag::Ce;
+    if (marked)
+    {
+        ++receive_metrics.ce_received;
+        ce_pending = true;
+    }
+
+    // Loss, reordering and congestion news goes back at once
+    bool urgent = !fresh || gap_before || reorder.has_gap () || marked
+               || (header.flags & (byte_t) PacketFlag::Fin);
+
+    if (urgent || unacked_count >= config.ack_every)
+        flush_ack ();
+}
+
+/**
+ * Skip the ids the sender gave up on, delivering any of them that did
+ * arrive, and ack at once so it stops repeating the notice
+ */
+void Connection::handle_forward (const PacketHeader& header, ns_t now)
+{
+    size_t skipped = profiled (profiler, Section::Reorder, [&]
+    {
+        return reorder.skip_to (header.id, [&] (const BufferedPacket& buffered)
+                                { return on_contiguous (buffered, now); });
+    });
+
+    if (skipped > 0)
+    {
+        receive_metrics.skipped += skipped;
+        event (Stage::Receiver, EventType::Abandoned, header.id);
+    }
+
+    pending_ack = {.header = {.type = PacketType::Ack,
+                              .id = (id_t) (reorder.expected () - 1),
+                              .send_ns = header.send_ns}};
+    flush_ack ();
+}
+
+/**
+ * Send the held ack, covering everything delivered so far. The held ack
+ * is dropped once sent.
+ */
+void Connection::flush_ack ()
+{
+    // Nothing held since the last flush: a pure window update, echoing no
+    // packet, so it yields no RTT sample at the sender
+    if (pending_ack.header.type != PacketType::Ack)
+        pending_ack = {.header = {.type = PacketType::Ack,
+                                  .id = (id_t) (reorder.expected () - 1)}};
+
+    pending_ack.cumulative = (id_t) reorder.expected ();
+    pending_ack.window = (id_t) reorder.window ();
+    advertised = reorder.window ();
+    if (ce_pending)
+        pending_ack.header.flags |= (byte_t) PacketFlag::Ece;
+
+    unacked_count = 0;
+    ce_pending = false;
+
+    ssize_t sent = profiled (profiler, Section::Send,
+                             [&] { return link->send_ack (pending_ack); });
+    if (sent < 0)
+        event (Stage::Receiver, EventType::AckFail, pending_ack.header.id);
+    else
+        ++receive_metrics.acks_sent;
+
+    pending_ack = {};
+}
+
+ns_t Connection::next_timer_ns () const
+{
+    ns_t due = std::numeric_limits<ns_t>::max ();
+    if (unacked_count > 0)
+        due = ack_deadline;
+
+    ns_t timeout_ns = config.retransmit_timeout * 1000000;
+    for (size_t ind = 0; ind < window.n; ++ind)
+    {
+        const WindowSlot& slot = window.out_buffer[ind];
+        if (slot.ack)
+            continue;
+
+        due = std::min (due, slot.header.send_ns + timeout_ns);
+        if (slot.expire_ns > 0)
+            due = std::min (due, slot.expire_ns);
+    }
+
+    if (forward_seq > peer_cumulative)
+        due = std::min (due, forward_sent_ns + timeout_ns);
+
+    if (bundle.count > 0)
+        due = std::min (due, bundle.deadline_ns);
+
+    return due;
+}
+
+/**
+ * Packet reached the contiguous delivery point. Returns true if it
+ * carries application data.
+ */
+bool Connection::on_contiguous (const BufferedPacket& buffered, ns_t now)
+{
+    PacketHeader header = buffered.packet.header ();
+    std::span<const byte_t> payload = buffered.packet.payload ();
+
+    event (Stage::Receiver, EventType::Delivered, header.id);
+    receive_metrics.hol_wait.record (now - buffered.arrival_ns);
+
+    if (!(header.flags & (byte_t) PacketFlag::Fin))
+    {
+        std::span<const byte_t> data = data_of (header, payload);
+        if (buffered.placed > 0)
+        {
+            // Checksum placed data where it went. If its message was
+            // dropped that memory is no longer ours, and the transfer
+            // cannot verify anyway.
+            FragmentHeader fragment = fragment_of (header, payload, 0);
+            if (incoming.destination.empty ()
+                || fragment.message_id != incoming.message_id)
+            {
+                receive_bytes += buffered.placed;
+                return true;
+            }
+
+            data = incoming.destination.subspan (fragment.offset,
+                                                 buffered.placed);
+        }
+
+        receive_checksum = checksum64 (data, receive_checksum);
+        receive_bytes += data.size ();
+        return true;
+    }
+
+    FinPayload fin {};
+    memcpy (&fin, payload.data (), std::min (payload.size (), sizeof (fin)));
+
+    fin_received = true;
+    fin_verified = be64toh (fin.total_bytes) == receive_bytes
+                && be64toh (fin.checksum) == receive_checksum;
+    return false;
+}
+
+ssize_t Connection::recv (std::span<byte_t> buffer)
+{
+    std::span<const byte_t> payload = peek ();
+    if (payload.empty () && reorder.front () == nullptr)
+    {
+        if (fin_received)
+            return 0;
+
+        errno = EAGAIN;
+        return -1;
+    }
+
+    size_t len = std::min (buffer.size (), payload.size ());
+    std::copy (payload.begin (), payload.begin () + len, buffer.begin ());
+    consume ();
+
+    return (ssize_t) len;
+}
+
+std::span<const byte_t> Connection::peek (size_t index) const
+{
+    const BufferedPacket* buffered = reorder.at (index);
+    if (buffered == nullptr)
+        return {};
+
+    return data_of (buffered->packet.header (), buffered->packet.payload ());
+}
+
+void Connection::consume ()
+{
+    if (reorder.front () != nullptr)
+        reorder.pop ();
+
+    incoming.record = 0;
+    incoming.record_offset = 0;
+    receive_metrics.buffered = reorder.size ();
+}
+
+ssize_t Connection::message_size () const
+{
+    const BufferedPacket* front = reorder.front ();
+    bool bundled = front != nullptr
+                && (front->packet.header ().flags
+                    & (byte_t) PacketFlag::Bundle);
+    if (incoming.active && !bundled)
+        return (ssize_t) incoming.length;
+
+    if (front == nullptr)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (bundled)
+    {
+        std::span<const byte_t> payload = front->packet.payload ();
+        size_t count = bundle_count (payload);
+        return incoming.record < count
+             ? (ssize_t) bundle_length (payload, count, incoming.record) : 0;
+    }
+
+    return (ssize_t) fragment_of (front->packet.header (),
+                                  front->packet.payload (),
+                                  incoming.message_id).length;
+}
+
+/**
+ * Give up on the message in progress, discarding the rest of it
+ */
+void Connection::drop_message ()
+{
+    ++receive_metrics.messages_dropped;
+    incoming.active = false;
+    incoming.discarding = true;
+    incoming.destination = {};
+}
+
+/**
+ * Copy the next message out of the bundle at the front, releasing the
+ * bundle after its last. Returns its length, 0 if the bundle was
+ * malformed and released, or -1 with EMSGSIZE.
+ */
+ssize_t Connection::recv_record (std::span<byte_t> destination)
+{
+    const BufferedPacket* front = reorder.front ();
+    std::span<const byte_t> payload = front->packet.payload ();
+    std::span<const byte_t> data = data_of (front->packet.header (),
+                                            payload);
+
+    size_t count = bundle_count (payload);
+    size_t length = incoming.record < count
+                  ? bundle_length (payload, count, incoming.record) : 0;
+    if (length == 0 || incoming.record_offset + length > data.size ())
+    {
+        // Malformed, lengths disagree
+        ++receive_metrics.messages_dropped;
+        consume ();
+        return 0;
+    }
+
+    if (length > destination.size ())
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    data = data.subspan (incoming.record_offset, length);
+    std::copy (data.begin (), data.end (), destination.begin ());
+    ++receive_metrics.messages_received;
+
+    if (++incoming.record == count)
+        consume ();
+    else
+        incoming.record_offset += length;
+
+    return (ssize_t) length;
+}
+
+ssize_t Connection::recv_message (std::span<byte_t> destination)
+{
+    while (const BufferedPacket* front = reorder.front ())
+    {
+        // A bundle means the sender was done with any message before it
+        if (front->packet.header ().flags & (byte_t) PacketFlag::Bundle)
+        {
+            if (incoming.active)
+                drop_message ();
+
+            ssize_t length = recv_record (destination);
+            if (length != 0)
+                return length;
+
+            continue;
+        }
+
+        PacketHeader header = front->packet.header ();
+        FragmentHeader fragment = fragment_of (header,
+                                               front->packet.payload (),
+                                               incoming.message_id);
+        std::span<const byte_t> data = data_of (header,
+                                                front->packet.payload ());
+        size_t size = front->placed > 0 ? front->placed : data.size ();
+        bool last = !(header.flags & (byte_t) PacketFlag::Frag)
+                 || (header.flags & (byte_t) PacketFlag::FragEnd);
+
+        // Anything but the next piece of the message in progress means
+        // the sender abandoned the rest of it
+        bool continues = incoming.active
+                      && fragment.message_id == incoming.message_id
+                      && fragment.offset == incoming.received;
+        if (!continues)
+        {
+            if (incoming.active)
+                drop_message ();
+
+            if (fragment.offset != 0)
+            {
+                // Its first fragment was abandoned
+                if (!incoming.discarding
+                    || fragment.message_id != incoming.message_id)
+                    drop_message ();
+
+                incoming.message_id = fragment.message_id;
+                consume ();
+                continue;
+            }
+
+            if (fragment.length > destination.size ())
+            {
+                errno = EMSGSIZE;
+                return -1;
+            }
+
+            incoming = {.active = true, .discarding = false,
+                        .message_id = fragment.message_id,
+                        .length = fragment.length, .received = 0,
+                        .destination = destination};
+        }
+
+        if (size > incoming.length - incoming.received
+            || (last && incoming.received + size != incoming.length))
+        {
+            // Malformed, lengths disagree
+            drop_message ();
+            consume ();
+            continue;
+        }
+
+        // Placed fragments are in destination already
+        if (front->placed == 0)
+            std::copy (data.begin (), data.end (),
+                       destination.begin () + incoming.received);
+        incoming.received += size;
+        consume ();
+
+        if (last)
+        {
+            incoming.active = false;
+            incoming.destination = {};
+            ++receive_metrics.messages_received;
+            return (ssize_t) incoming.length;
+        }
+    }
+
+    if (fin_received)
+    {
+        if (incoming.active)
+            drop_message ();
+        return 0;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/**** DRIVER ****/
+
+void Connection::service ()
+{
+    // Drain everything the socket holds, timing each packet by its arrival
+    // rather than by when this loop got to it. Pooled links hand packets
+    // over whole; socket reads land in scratch and are copied once, into
+    // the reorder buffer or a message being received.
+    bool pooled = link->pooled ();
+    UnionPacket packet;
+    PacketRef ref;
+    ns_t arrival_ns = 0;
+    auto receive = [&]
+    {
+        SectionScope scope (profiler, Section::Receive);
+        if (pooled)
+            return link->receive_ref (ref, arrival_ns);
+
+        return link->receive (packet, arrival_ns) > 0;
+    };
+
+    // How late the first packet was picked up, the wakeup latency
+    bool first = true;
+    while (receive ())
+    {
+        PacketType type = pooled ? ref.header ().type
+                                 : packet.ack_packet.header.type;
+        if (first)
+        {
+            bool data = type == PacketType::Data;
+            (data ? receive_metrics.wakeup : send_metrics.wakeup)
+                .record (get_time_ns () - arrival_ns);
+            first = false;
+        }
+
+        switch (type)
+        {
+            case PacketType::Data:
+                if (pooled)
+                    handle_data (std::move (ref), 0, arrival_ns);
+                else
+                    receive_data (packet.data_packet, arrival_ns);
+                break;
+            case PacketType::Ack:
+                handle_ack (pooled ? ref.ack () : packet.ack_packet,
+                            arrival_ns);
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Deliver contiguous packets, send a delayed ack if due
+    ns_t now = get_time_ns ();
+    {
+        SectionScope scope (profiler, Section::Reorder);
+        reorder.advance ([&] (const BufferedPacket& buffered)
+                         { return on_contiguous (buffered, now); });
+    }
+    receive_metrics.buffered = reorder.size ();
+
+    // Tell the sender when a closed window opens, or the window grew by
+    // half the buffer, rather than wait for its next data or probe
+    size_t room = reorder.window ();
+    bool opened = (advertised == 0 && room > 0)
+               || room >= advertised + std::max<size_t> (
+                                          1, config.receive_window / 2);
+    if ((unacked_count > 0 && now >= ack_deadline) || opened)
+        flush_ack ();
+
+    // Give up on expired packets, shift the window, then resend anything
+    // unacked past its timeout
+    abandon_expired (now);
+    window.try_shift ();
+
+    ns_t timeout_ns = config.retransmit_timeout * 1000000;
+    for (size_t ind = 0; ind < window.n; ++ind)
+    {
+        WindowSlot& slot = window.out_buffer[ind];
+        if (slot.ack || now - slot.header.send_ns < timeout_ns)
+            continue;
+
+        if (!transmit (slot))
+            break;
+    }
+
+    // Then more of the outgoing message, if the window opened, and the
+    // pending bundle once due
+    pump_message ();
+    if (bundle.count > 0 && now >= bundle.deadline_ns)
+        flush_bundle ();
+
+    send_metrics.in_flight = window.unacked ();
+    send_metrics.mean_latency = (float) (send_metrics.rtt.mean () / 1e6);
+}
@@ -6,38 +6,68 @@
 
 #include "network.h"
 #include "hazards.h"
+#include "aqm.h"
 #include "metrics.h"
 #include "helpers.h"
 #include "display.h"
+#include "exporter.h"
+#include "perf.h"
+#include "lowlatency.h"
+#include "trace.h"
+#include "capture.h"
+#include "scheduler.h"
+#include "buffer.h"
+#include "timer.h"
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <variant>
-#include <queue>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 #include <poll.h>
 
 /**
- * DataPacket with forwarding timing info
+ * Packet with forwarding timing info, stored at its received size
  */
 struct TimedPacket
 {
-    ms_t out_ms;
-    UnionPacket packet;
-
-    TimedPacket (ms_t out_ms, UnionPacket packet)
-        : out_ms (out_ms), packet (packet) {}
+    ns_t out_ns;
+    size_t flow;
+    id_t id;
+    PacketRef packet;
 
     bool operator > (const TimedPacket& rhs) const
     {
-        if (this->out_ms == rhs.out_ms)
-            return this->packet.ack_packet.header.id >
-                         rhs.packet.ack_packet.header.id;
+        if (this->out_ns == rhs.out_ns)
+            return id_before (rhs.id, this->id);
 
-        return this->out_ms > rhs.out_ms;
+        return this->out_ns > rhs.out_ns;
     }
 };
 
+/**
+ * Data waiting for the bottleneck, with when it joined the queue
+ */
+struct QueuedPacket
+{
+    PacketRef packet;
+    ns_t enqueue_ns;
+    bool marked;        // congestion experienced on the way in
+};
+
+/**
+ * One sender/receiver pair routed through the emulator
+ */
+struct Flow
+{
+    sockaddr_in sender_addr;        // data source, ack destination
+    sockaddr_in receiver_addr;      // data destination, ack source
+};
+
 /**
  * Parsed arguments for emulator
  */
@@ -45,8 +75,13 @@ struct Args
 {
     int receive_sock;
     int send_sock;
-    sockaddr_in ack_dest_addr;
-    sockaddr_in data_dest_addr;
+    std::vector<Flow> flows;
+    double bottleneck_rate;         // bytes/sec, 0 for unlimited
+    size_t quantum;
+    size_t queue_limit;             // bottleneck packets before tail drop
+    std::string aqm;                // per-flow queue discipline
+    std::vector<double> aqm_params;
+    bool ecn;                       // discipline marks instead of dropping
     std::variant<RandomLoss, BurstLoss, ShallowBuffer, RandomJitter> hazard;
 };
 
@@ -58,11 +93,22 @@ std::optional<Args> parse_args (int argc, char* argv[])
     if (argc < 6)
     {
         std::cerr << "Usage: ./emulator [recv bind] [ack bind] [receiver port] [sender port] [hazard]"
+                     " [--flow sender:receiver]... [--bottleneck bytes/s]"
+                     " [--quantum bytes] [--queue-limit packets]"
+                     " [--aqm fifo|red:min,max,p|codel:target,interval]"
+                     " [--ecn] [--headless] [--metrics file]"
+                     " [--trace file] [--capture file] [--snaplen bytes]"
+                     " [--perf] [--shm]"
+                     " [--cpus list] [--busy-poll] [--fifo priority]"
                   << std::endl;
 
         return std::nullopt;
     }
 
+    // Same-host shared memory instead of UDP, peers must agree
+    if (has_flag (argc, argv, "--shm"))
+        use_shm_transport ();
+
     // [recv bind] - receive data from sender
     int recv_bind = atoi (argv[1]);
     int receive_sock = create_udp_socket ();
@@ -75,6 +121,9 @@ std::optional<Args> parse_args (int argc, char* argv[])
         return std::nullopt;
     }
 
+    set_nonblocking (receive_sock);
+    enable_rx_timestamps (receive_sock);
+
     // [ack bind] - receive ACKs from receiver
     int ack_bind = atoi (argv[2]);
     int send_sock = create_udp_socket ();
@@ -87,13 +136,60 @@ std::optional<Args> parse_args (int argc, char* argv[])
         return std::nullopt;
     }
 
-    // [receiver port] - forward data to receiver
-    int receiver_port = atoi (argv[3]);
-    sockaddr_in data_dest_addr = make_dest_addr ("127.0.0.1", receiver_port);
+    set_nonblocking (send_sock);
+    enable_rx_timestamps (send_sock);
 
-    // [sender port] - forward ACKs to sender
+    // [receiver port] [sender port] - first flow
+    int receiver_port = atoi (argv[3]);
     int sender_port = atoi (argv[4]);
-    sockaddr_in ack_dest_addr = make_dest_addr ("127.0.0.1", sender_port);
+
+    std::vector<Flow> flows;
+    flows.push_back ({.sender_addr = make_dest_addr ("127.0.0.1", sender_port),
+                      .receiver_addr = make_dest_addr ("127.0.0.1",
+                                                       receiver_port)});
+
+    // --flow sender:receiver - any number of extra flows
+    for (int i = 6; i + 1 < argc; ++i)
+    {
+        if (std::strcmp (argv[i], "--flow") != 0)
+            continue;
+
+        int flow_sender = 0;
+        int flow_receiver = 0;
+        if (std::sscanf (argv[i + 1], "%d:%d", &flow_sender,
+                         &flow_receiver) != 2)
+        {
+            std::cerr << "Bad flow " << argv[i + 1]
+                      << ", expected sender:receiver" << std::endl;
+            return std::nullopt;
+        }
+
+        flows.push_back ({.sender_addr = make_dest_addr ("127.0.0.1",
+                                                         flow_sender),
+                          .receiver_addr = make_dest_addr ("127.0.0.1",
+                                                           flow_receiver)});
+    }
+
+    // --bottleneck: shared forward link rate, fair queued across flows
+    const char* bottleneck = get_option (argc, argv, "--bottleneck");
+    const char* quantum = get_option (argc, argv, "--quantum");
+    const char* queue_limit = get_option (argc, argv, "--queue-limit");
+
+    // --aqm name:params - discipline on each flow's bottleneck queue
+    const char* aqm_option = get_option (argc, argv, "--aqm");
+    std::string aqm_arg = aqm_option ? aqm_option : "fifo";
+    std::string aqm = aqm_arg.substr (0, aqm_arg.find (':'));
+    std::vector<double> aqm_params;
+    for (size_t pos = aqm_arg.find (':'); pos != std::string::npos;
+         pos = aqm_arg.find (',', pos + 1))
+        aqm_params.push_back (atof (aqm_arg.c_str () + pos + 1));
+
+    if (!make_queue_discipline (aqm, aqm_params))
+    {
+        std::cerr << "Unknown queue discipline: " << aqm << std::endl;
+        std::cerr << "Disciplines: fifo, red, codel" << std::endl;
+        return std::nullopt;
+    }
 
     // [hazard]
     std::string hazard_name = argv[5];
@@ -118,8 +214,14 @@ std::optional<Args> parse_args (int argc, char* argv[])
     // Return
     return Args {.receive_sock = receive_sock,
                  .send_sock = send_sock,
-                 .ack_dest_addr = ack_dest_addr,
-                 .data_dest_addr = data_dest_addr,
+                 .flows = flows,
+                 .bottleneck_rate = bottleneck ? atof (bottleneck) : 0.0,
+                 .quantum = quantum ? (size_t) atol (quantum) : 1500,
+                 .queue_limit = queue_limit ? (size_t) atol (queue_limit)
+                                            : 1000,
+                 .aqm = aqm,
+                 .aqm_params = aqm_params,
+                 .ecn = has_flag (argc, argv, "--ecn"),
                  .hazard = hazard};
 }
 
@@ -134,104 +236,396 @@ int main (int argc, char* argv[])
         return EXIT_FAILURE;
 
     std::string hazard_name = argv[5];
+    if (args->aqm != "fifo")
+        hazard_name += ", " + args->aqm + (args->ecn ? " ecn" : "");
 
-    constexpr size_t nfds = 2;
+    // --cpus, --busy-poll, --fifo: low-latency mode, set up before any
+    // helper thread starts so helpers stay off the network thread's cpu
+    auto low_latency_options = parse_low_latency (argc, argv);
+    if (!low_latency_options)
+        return EXIT_FAILURE;
+
+    LowLatencyMode low_latency (*low_latency_options);
+    low_latency.tune_socket (args->receive_sock);
+    low_latency.tune_socket (args->send_sock);
+
+    // --headless: no terminal rendering, --metrics: json lines snapshots
+    bool headless = has_flag (argc, argv, "--headless");
+    MetricsExporter exporter (get_option (argc, argv, "--metrics"));
+    Tracer tracer (get_option (argc, argv, "--trace"), Stage::Emulator);
+
+    // --perf: hardware counters around hot sections, reported per packet
+    // in the metrics snapshots
+    std::unique_ptr<SectionProfiler> profiler;
+    if (has_flag (argc, argv, "--perf"))
+    {
+        profiler = std::make_unique<SectionProfiler> ();
+        if (!profiler->is_open ())
+            std::cerr << "Hardware counters unavailable, counting calls only"
+                      << std::endl;
+        exporter.set_profiler (profiler.get ());
+    }
+
+    // --capture: pcapng of every packet in, dropped and out
+    const char* snaplen = get_option (argc, argv, "--snaplen");
+    PacketCapture capture (get_option (argc, argv, "--capture"),
+                           snaplen ? (size_t) atol (snaplen) : 65535);
+    sockaddr_in data_addr = make_dest_addr ("127.0.0.1", atoi (argv[1]));
+    sockaddr_in ack_addr = make_dest_addr ("127.0.0.1", atoi (argv[2]));
+
+    // Releases and link departures wake the loop through a timerfd at
+    // their exact deadline, the poll timeout only paces housekeeping.
+    // Without a timerfd, fall back to polling every millisecond.
+    DeadlineTimer timer;
+    set_timer_slack (1000);
+
+    constexpr size_t nfds = 3;
     pollfd pollfds[nfds] = {{.fd = args->receive_sock, .events = POLLIN},
-                            {.fd = args->send_sock, .events = POLLIN}};
-    constexpr int timeout = (int) (ms_t {1});
+                            {.fd = args->send_sock, .events = POLLIN},
+                            {.fd = timer.fd (), .events = POLLIN}};
+    const int timeout = (int) (timer.is_open () ? ms_t {100} : ms_t {1});
+    constexpr size_t max_batch = 64;
+
+    // Flow table: data classified by sender address, acks by receiver
+    std::unordered_map<uint64_t, size_t> data_flows;
+    std::unordered_map<uint64_t, size_t> ack_flows;
+    for (size_t ind = 0; ind < args->flows.size (); ++ind)
+    {
+        data_flows[address_key (args->flows[ind].sender_addr)] = ind;
+        ack_flows[address_key (args->flows[ind].receiver_addr)] = ind;
+    }
 
     /**** START EMULATE ****/
+    // Packets arrive in one scratch buffer and are queued in blocks sized
+    // to them, so a queued ack costs 64 bytes rather than a DataPacket
     UnionPacket packet {};
-    std::priority_queue<TimedPacket, std::vector<TimedPacket>,
-                        std::greater<TimedPacket>> out_queue {};
+    sockaddr_in from {};
+    PacketPool pool;
+
+    // Min-heap on release time, a vector so entries can be moved out
+    std::vector<TimedPacket> out_queue {};
+    auto later = std::greater<TimedPacket> {};
+
+    // Shared bottleneck on the forward path, each flow's queue under its
+    // own discipline
+    DrrScheduler<QueuedPacket> bottleneck (args->flows.size (),
+                                           args->quantum);
+    ns_t link_free_ns = 0;
+
+    std::vector<std::unique_ptr<QueueDiscipline>> disciplines;
+    for (size_t ind = 0; ind < args->flows.size (); ++ind)
+        disciplines.push_back (make_queue_discipline (
+            args->aqm, args->aqm_params, args->ecn, (unsigned int) ind));
 
     EmulatorMetrics metrics {};
-    Display display {};
+    metrics.flows.resize (args->flows.size ());
+    Display display {!headless};
 
-    while (true)
+    auto event = [&] (EventType type, id_t id, uint32_t arg = 0)
     {
-        ms_t time_ms = get_time_ms ();
-        int ready = poll (pollfds, nfds, timeout);
-        if (ready < 1)
-            continue;
+        TraceEvent trace_event = tracer.make (type, id, arg);
+        display.add_event (trace_event);
+        tracer.record (trace_event);
+    };
 
-        /*** PASS DATA FROM SENDER TO RECEIVER ***/
-        if (pollfds[0].revents & POLLIN)
-        {
-            if (receive_data (args->receive_sock, packet.data_packet) < 1)
-            {
-                std::cerr << "Issue reading from socket" << std::endl;
-                continue;
-            }
-        }
+    auto render = [&] ()
+    {
+        if (!display.is_enabled ())
+            return;
 
-        /*** PASS ACK FROM RECEIVER TO SENDER ***/
-        // TODO: Drops if send, fix
-        else if (pollfds[1].revents & POLLIN)
+        SectionScope scope (profiler.get (), Section::Display);
+        std::string stats =
+            "  Fwd Data: " + std::to_string (metrics.fwd_data) +
+            "  |  Fwd Ack: " + std::to_string (metrics.fwd_acks) +
+            "  |  Dropped: " + std::to_string (metrics.dropped) +
+            "  |  Marked: " + std::to_string (metrics.marked) +
+            "  |  Queued: " + std::to_string (metrics.queued) +
+            "  |  Buffers: " + std::to_string (metrics.buffer_bytes / 1024)
+                + " KB";
+
+        // Wakeup latency, then one line per flow once there is more
+        // than one
+        std::vector<std::string> details {
+            "  " + metrics.wakeup.summary ("Wakeup")};
+        if (capture.is_open ())
+            details.push_back ("  Capture records dropped: "
+                               + std::to_string (metrics.capture_dropped));
+        for (size_t ind = 0; args->flows.size () > 1
+                             && ind < metrics.flows.size (); ++ind)
         {
-            if (receive_ack (args->send_sock, packet.ack_packet, ms_t {0}) < 1)
-            {
-                std::cerr << "Issue reading from socket" << std::endl;
-                continue;
-            }
-
-            time_ms = get_time_ms ();
+            const FlowMetrics& flow = metrics.flows[ind];
+            details.push_back (
+                "  Flow " + std::to_string (ind) +
+                "  |  Data: " + std::to_string (flow.fwd_data) +
+                "  |  KB: " + std::to_string (flow.fwd_bytes / 1024) +
+                "  |  Dropped: " + std::to_string (flow.dropped) +
+                "  |  Marked: " + std::to_string (flow.marked) +
+                "  |  Queued: " + std::to_string (flow.queued));
         }
 
-        /*** APPLY HAZARDS ***/
+        display.render ("--- Emulator (" + hazard_name + ") ---", stats,
+                        details);
+    };
+
+    /**
+     * Capture a data packet of a flow. Data comes in from the sender on
+     * the data socket and leaves for the receiver from the ack socket.
+     */
+    auto capture_data = [&] (CaptureEvent what, ns_t time_ns, size_t flow,
+                             const PacketHeader& header,
+                             std::span<const byte_t> payload)
+    {
+        const Flow& route = args->flows[flow];
+        if (what == CaptureEvent::Forwarded)
+            capture.record_data (what, time_ns, ack_addr,
+                                 route.receiver_addr, header, payload);
+        else
+            capture.record_data (what, time_ns, route.sender_addr,
+                                 data_addr, header, payload);
+    };
+
+    /**
+     * Capture an ack of a flow, which takes the reverse route
+     */
+    auto capture_ack = [&] (CaptureEvent what, ns_t time_ns, size_t flow,
+                            const AckPacket& ack)
+    {
+        const Flow& route = args->flows[flow];
+        if (what == CaptureEvent::Forwarded)
+            capture.record_ack (what, time_ns, data_addr, route.sender_addr,
+                                ack);
+        else
+            capture.record_ack (what, time_ns, route.receiver_addr,
+                                ack_addr, ack);
+    };
+
+    /**
+     * Apply hazards to a packet of a flow and schedule it, delayed from
+     * when it reached the host
+     */
+    auto ingest = [&] (size_t flow, ns_t arrival_ns)
+    {
         id_t pkt_id = packet.ack_packet.header.id;
-        std::string type_str = packet.ack_packet.header.type == PacketType::Data
-                             ? "data" : "ack";
+        PacketType type = packet.ack_packet.header.type;
 
-        auto effects = std::visit (
-            [&] (auto& h) { return h.get_effects (packet.ack_packet.header.type,
-                                                  packet.ack_packet.header.id); },
-            args->hazard);
+        auto effects = profiled (profiler.get (), Section::Hazard, [&]
+        {
+            return std::visit (
+                [&] (auto& h) { return h.get_effects (type, pkt_id); },
+                args->hazard);
+        });
+
+        if (capture.is_open ())
+        {
+            CaptureEvent what = effects.drop ? CaptureEvent::Dropped
+                                             : CaptureEvent::Received;
+            if (type == PacketType::Data)
+                capture_data (what, arrival_ns, flow,
+                              packet.data_packet.header,
+                              {packet.data_packet.payload.data (),
+                               packet.data_packet.byte_count});
+            else
+                capture_ack (what, arrival_ns, flow, packet.ack_packet);
+        }
 
         if (effects.drop)
         {
             ++metrics.dropped;
-            display.add_event ("Dropped  ID " + std::to_string (pkt_id) +
-                               " (" + type_str + ")");
+            ++metrics.flows[flow].dropped;
+            event (EventType::Dropped, pkt_id, (uint32_t) type);
+            return;
+        }
+
+        if (effects.delay_ns > 0)
+            event (EventType::Queued, pkt_id,
+                   (uint32_t) ns_to_ms (effects.delay_ns));
+
+        SectionScope scope (profiler.get (), Section::Queue);
+        PacketRef stored = type == PacketType::Data
+                         ? pool.store (packet.data_packet)
+                         : pool.store (packet.ack_packet);
+
+        out_queue.push_back ({.out_ns = arrival_ns + effects.delay_ns,
+                              .flow = flow, .id = pkt_id,
+                              .packet = std::move (stored)});
+        std::push_heap (out_queue.begin (), out_queue.end (), later);
+    };
+
+    /**
+     * Count a data packet the bottleneck queue dropped
+     */
+    auto queue_drop = [&] (size_t flow, const PacketRef& data, ns_t now_ns)
+    {
+        PacketHeader header = data.header ();
+        ++metrics.dropped;
+        ++metrics.flows[flow].dropped;
+        event (EventType::Dropped, header.id, (uint32_t) PacketType::Data);
+        capture_data (CaptureEvent::Dropped, now_ns, flow, header,
+                      data.payload ());
+    };
+
+    /**
+     * Apply a discipline's signal, returns false if the packet is dropped.
+     * Only ECN capable packets can be marked.
+     */
+    auto apply_verdict = [&] (QueueVerdict verdict, size_t flow,
+                              const PacketRef& data, bool& marked,
+                              ns_t now_ns)
+    {
+        bool capable = data.header ().flags & (byte_t) PacketFlag::Ect;
+        if (verdict == QueueVerdict::Drop
+            || (verdict == QueueVerdict::Mark && !capable))
+        {
+            queue_drop (flow, data, now_ns);
+            return false;
+        }
 
-            std::string stats =
-                "  Fwd Data: " + std::to_string (metrics.fwd_data) +
-                "  |  Fwd Ack: " + std::to_string (metrics.fwd_acks) +
-                "  |  Dropped: " + std::to_string (metrics.dropped) +
-                "  |  Queued: " + std::to_string (out_queue.size ());
+        if (verdict == QueueVerdict::Mark && !marked)
+        {
+            marked = true;
+            ++metrics.marked;
+            ++metrics.flows[flow].marked;
+        }
 
-            display.render ("--- Emulator (" + hazard_name + ") ---", stats);
-            continue;
+        return true;
+    };
+
+    low_latency.enter ();
+    while (true)
+    {
+        metrics.queued = out_queue.size () + bottleneck.size ();
+        metrics.buffer_bytes = pool.reserved_bytes ();
+        metrics.capture_dropped = capture.dropped_records ();
+        exporter.tick (metrics);
+
+        // Wake for the next release, or the link freeing up for more
+        ns_t deadline = out_queue.empty () ? 0 : out_queue.front ().out_ns;
+        if (!bottleneck.empty () && args->bottleneck_rate > 0)
+            deadline = deadline > 0 ? std::min (deadline, link_free_ns)
+                                    : link_free_ns;
+
+        if (deadline > 0)
+            timer.arm (deadline);
+        else
+            timer.disarm ();
+
+        int ready = low_latency.poll (pollfds, nfds, timeout);
+        ns_t arrival_ns = 0;
+
+        // Wakeup latency: how late a deadline or the first packet is seen
+        if (ready > 0 && (pollfds[2].revents & POLLIN))
+        {
+            metrics.wakeup.record (get_time_ns () - timer.deadline ());
+            timer.clear ();
+        }
+
+        bool first = true;
+        auto woken = [&] (ns_t stamp_ns)
+        {
+            if (first)
+                metrics.wakeup.record (get_time_ns () - stamp_ns);
+            first = false;
+        };
+
+        /*** PASS DATA FROM SENDER TO RECEIVER ***/
+        // Drain a batch per wakeup, shared memory always needs a look
+        bool shm = ShmTransport::enabled;
+        if (shm || (ready > 0 && (pollfds[0].revents & POLLIN)))
+        {
+            for (size_t count = 0; count < max_batch; ++count)
+            {
+                if (profiled (profiler.get (), Section::Receive, [&]
+                    { return receive_data (args->receive_sock,
+                                           packet.data_packet, &from,
+                                           &arrival_ns); }) < 1)
+                    break;
+
+                woken (arrival_ns);
+
+                if (auto it = data_flows.find (address_key (from));
+                    it != data_flows.end ())
+                    ingest (it->second, arrival_ns);
+                else
+                    ++metrics.unrouted;
+            }
         }
 
-        if (effects.delay > 0)
-            display.add_event ("Queued   ID " + std::to_string (pkt_id) +
-                               " (+" + std::to_string (effects.delay) +
-                               "ms)");
+        /*** PASS ACK FROM RECEIVER TO SENDER ***/
+        if (shm || (ready > 0 && (pollfds[1].revents & POLLIN)))
+        {
+            for (size_t count = 0; count < max_batch; ++count)
+            {
+                if (profiled (profiler.get (), Section::Receive, [&]
+                    { return receive_packet (args->send_sock, packet, &from,
+                                             &arrival_ns); }) < 1)
+                    break;
 
-        out_queue.emplace (time_ms + effects.delay, packet);
+                woken (arrival_ns);
+
+                if (auto it = ack_flows.find (address_key (from));
+                    it != ack_flows.end ())
+                    ingest (it->second, arrival_ns);
+                else
+                    ++metrics.unrouted;
+            }
+        }
 
-        /*** FORWARD PACKETS ***/
-        while (!out_queue.empty () && out_queue.top ().out_ms < time_ms + 1)
+        /*** RELEASE DELAYED PACKETS ***/
+        // Acks go straight back, data waits for the bottleneck
+        ns_t now_ns = get_time_ns ();
+        while (!out_queue.empty () && out_queue.front ().out_ns <= now_ns)
         {
-            switch (out_queue.top ().packet.ack_packet.header.type)
+            TimedPacket timed = profiled (profiler.get (), Section::Queue, [&]
+            {
+                std::pop_heap (out_queue.begin (), out_queue.end (), later);
+                TimedPacket next = std::move (out_queue.back ());
+                out_queue.pop_back ();
+                return next;
+            });
+
+            const Flow& flow = args->flows[timed.flow];
+
+            switch (timed.packet.header ().type)
             {
                 case PacketType::Data:
                 {
-                    DataPacket out_data = out_queue.top ().packet.data_packet;
-                    ++metrics.fwd_data;
-                    display.add_event ("Fwd Data ID " +
-                                       std::to_string (out_data.header.id));
-                    send_data (args->send_sock, out_data, args->data_dest_addr);
+                    size_t backlog = bottleneck.size (timed.flow);
+                    if (backlog >= args->queue_limit)
+                    {
+                        queue_drop (timed.flow, timed.packet, now_ns);
+                        break;
+                    }
+
+                    bool marked = false;
+                    QueueVerdict verdict = profiled (
+                        profiler.get (), Section::Queue, [&]
+                        { return disciplines[timed.flow]
+                              ->on_enqueue (backlog, now_ns); });
+                    if (!apply_verdict (verdict, timed.flow, timed.packet,
+                                        marked, now_ns))
+                        break;
+
+                    size_t wire_bytes = timed.packet.size ();
+                    SectionScope scope (profiler.get (), Section::Queue);
+                    bottleneck.enqueue (timed.flow,
+                                        {.packet = std::move (timed.packet),
+                                         .enqueue_ns = now_ns,
+                                         .marked = marked},
+                                        wire_bytes);
+                    ++metrics.flows[timed.flow].queued;
                     break;
                 }
                 case PacketType::Ack:
                 {
-                    AckPacket out_ack = out_queue.top ().packet.ack_packet;
+                    AckPacket out_ack = timed.packet.ack ();
                     ++metrics.fwd_acks;
-                    display.add_event ("Fwd Ack  ID " +
-                                       std::to_string (out_ack.header.id));
-                    send_ack (args->receive_sock, out_ack, args->ack_dest_addr);
+                    ++metrics.flows[timed.flow].fwd_acks;
+                    event (EventType::FwdAck, out_ack.header.id);
+                    profiled (profiler.get (), Section::Send, [&]
+                    { return send_ack (args->receive_sock, out_ack,
+                                       flow.sender_addr); });
+                    capture_ack (CaptureEvent::Forwarded, now_ns, timed.flow,
+                                 out_ack);
                     break;
                 }
                 default:
@@ -240,17 +634,55 @@ int main (int argc, char* argv[])
                     break;
                 }
             }
+        }
+
+        /*** FORWARD DATA OVER THE BOTTLENECK ***/
+        now_ns = get_time_ns ();
+        while (!bottleneck.empty ()
+               && (args->bottleneck_rate <= 0 || link_free_ns <= now_ns))
+        {
+            auto next = profiled (profiler.get (), Section::Queue,
+                                  [&] { return bottleneck.dequeue (); });
+            auto [flow, queued] = std::move (*next);
+            const PacketRef& out_data = queued.packet;
+            size_t wire_bytes = out_data.size ();
+            PacketHeader header = out_data.header ();
+            --metrics.flows[flow].queued;
+
+            ns_t sojourn_ns = now_ns - queued.enqueue_ns;
+            QueueVerdict verdict = profiled (profiler.get (), Section::Queue,
+                [&] { return disciplines[flow]->on_dequeue (
+                          sojourn_ns, bottleneck.size (flow), now_ns); });
+            if (!apply_verdict (verdict, flow, out_data, queued.marked,
+                                now_ns))
+                continue;
 
-            out_queue.pop ();
+            if (queued.marked)
+                header.flags |= (byte_t) PacketFlag::Ce;
+
+            ++metrics.fwd_data;
+            ++metrics.flows[flow].fwd_data;
+            metrics.flows[flow].fwd_bytes += wire_bytes;
+            event (EventType::FwdData, header.id);
+            profiled (profiler.get (), Section::Send, [&]
+            {
+                return send_data_view (args->send_sock, header,
+                                       out_data.payload (),
+                                       args->flows[flow].receiver_addr);
+            });
+            capture_data (CaptureEvent::Forwarded, now_ns, flow, header,
+                          out_data.payload ());
+
+            // Link is busy for the serialization time of this packet
+            if (args->bottleneck_rate > 0)
+                link_free_ns = std::max (link_free_ns, now_ns)
+                             + (ns_t) (wire_bytes * 1e9
+                                       / args->bottleneck_rate);
         }
 
         // Render display
-        std::string stats =
-            "  Fwd Data: " + std::to_string (metrics.fwd_data) +
-            "  |  Fwd Ack: " + std::to_string (metrics.fwd_acks) +
-            "  |  Dropped: " + std::to_string (metrics.dropped) +
-            "  |  Queued: " + std::to_string (out_queue.size ());
-
-        display.render ("--- Emulator (" + hazard_name + ") ---", stats);
+        metrics.queued = out_queue.size () + bottleneck.size ();
+        if (ready > 0)
+            render ();
     }
 }
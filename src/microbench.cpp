@@ -0,0 +1,338 @@
+/**
+ * @file microbench.cpp
+ * @brief Timing loops for the per-packet hot paths
+ */
+
+#include "pacer.h"
+#include "window.h"
+#include "reorder.h"
+#include "network.h"
+#include "display.h"
+#include "perf.h"
+#include "hazard/hazards.h"
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/**** ALLOCATION COUNTING ****/
+
+static std::atomic<size_t> allocations {0};
+
+void* operator new (size_t size)
+{
+    allocations.fetch_add (1, std::memory_order_relaxed);
+
+    // Refuse impossible sizes up front, so malloc never sees one
+    if (size > (size_t) PTRDIFF_MAX)
+        throw std::bad_alloc ();
+
+    if (void* ptr = std::malloc (size ? size : 1))
+        return ptr;
+
+    throw std::bad_alloc ();
+}
+
+void* operator new[] (size_t size) { return operator new (size); }
+void operator delete (void* ptr) noexcept { std::free (ptr); }
+void operator delete[] (void* ptr) noexcept { std::free (ptr); }
+void operator delete (void* ptr, size_t) noexcept { std::free (ptr); }
+void operator delete[] (void* ptr, size_t) noexcept { std::free (ptr); }
+
+/**** HARNESS ****/
+
+/**
+ * Keep the compiler from discarding a result
+ */
+template <typename T>
+inline void keep (const T& value)
+{
+    asm volatile ("" : : "r,m" (value) : "memory");
+}
+
+/**
+ * Runs and reports benchmarks matching an optional name filter. Reports
+ * go to a copy of stdout taken up front, so benchmarks may redirect the
+ * real one.
+ */
+class Bench
+{
+private:
+    size_t iterations;
+    const char* filter;
+    PerfCounters* perf;
+    FILE* out;
+
+public:
+    Bench (size_t iterations, const char* filter, PerfCounters* perf)
+        : iterations (iterations), filter (filter), perf (perf),
+          out (fdopen (dup (STDOUT_FILENO), "w"))
+    {
+        std::fprintf (out, "%-32s %10s %10s", "benchmark", "ns/op",
+                      "allocs/op");
+        if (perf != nullptr)
+            std::fprintf (out, " %10s %10s %10s %10s", "cycles/op",
+                          "instr/op", "llc-miss", "br-miss");
+        std::fprintf (out, "\n");
+    }
+
+    ~Bench () { std::fclose (out); }
+
+    Bench (const Bench&) = delete;
+    Bench& operator = (const Bench&) = delete;
+
+    /**
+     * Time iterations / divisor calls of op (i) after a warmup of a tenth
+     * as many, i counting up across both. Slow operations pass a divisor
+     * to keep runs short.
+     */
+    template <typename Op>
+    void run (const std::string& name, Op&& op, size_t divisor = 1)
+    {
+        if (filter != nullptr && name.find (filter) == std::string::npos)
+            return;
+
+        size_t count = std::max<size_t> (iterations / divisor, 1);
+        size_t warmup = count / 10;
+        for (size_t i = 0; i < warmup; ++i)
+            op (i);
+
+        size_t allocs_start = allocations.load (std::memory_order_relaxed);
+        CounterValues counters_start = perf
+            ? perf->read () : CounterValues {};
+        ns_t start = get_time_ns ();
+
+        for (size_t i = warmup; i < warmup + count; ++i)
+            op (i);
+
+        ns_t elapsed = get_time_ns () - start;
+        CounterValues counters = perf
+            ? perf->read () - counters_start : CounterValues {};
+        size_t allocs = allocations.load (std::memory_order_relaxed)
+                      - allocs_start;
+
+        std::fprintf (out, "%-32s %10.1f %10.3f", name.c_str (),
+                      (double) elapsed / count, (double) allocs / count);
+        if (perf != nullptr)
+            std::fprintf (out, " %10.1f %10.1f %10.3f %10.3f",
+                          (double) counters[Counter::Cycles] / count,
+                          (double) counters[Counter::Instructions] / count,
+                          (double) counters[Counter::CacheMisses] / count,
+                          (double) counters[Counter::BranchMisses] / count);
+        std::fprintf (out, "\n");
+        std::fflush (out);
+    }
+};
+
+/**
+ * Data packet with a full payload and a given id
+ */
+static DataPacket make_packet (id_t id)
+{
+    DataPacket packet {};
+    packet.header = {.type = PacketType::Data, .id = id};
+    packet.byte_count = MAX_PAYLOAD_BYTE_COUNT;
+    return packet;
+}
+
+/**
+ * Runner
+ */
+int main (int argc, char* argv[])
+{
+    /**** PARSE ARGS ****/
+    if (has_flag (argc, argv, "--help"))
+    {
+        std::cerr << "Usage: ./pacer_microbench [--filter name]"
+                     " [--iterations n] [--perf]" << std::endl;
+        std::cerr << "--perf adds hardware counters per op where"
+                     " perf_event_open is permitted." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const char* iterations_option = get_option (argc, argv, "--iterations");
+    size_t iterations = iterations_option
+        ? (size_t) atoll (iterations_option) : 1000000;
+
+    std::unique_ptr<PerfCounters> perf;
+    if (has_flag (argc, argv, "--perf"))
+    {
+        perf = std::make_unique<PerfCounters> ();
+        if (!perf->is_open ())
+        {
+            std::cerr << "Hardware counters unavailable, timing only"
+                      << std::endl;
+            perf.reset ();
+        }
+    }
+
+    Bench bench (iterations, get_option (argc, argv, "--filter"),
+                 perf.get ());
+
+    /**** PACING ****/
+    {
+        // Fast enough to never run dry, so every call takes a token
+        TokenBucket bucket (1e12, 1e12);
+        bench.run ("TokenBucket::try_consume", [&] (size_t)
+        {
+            keep (bucket.try_consume ());
+        });
+    }
+
+    /**** HAZARDS ****/
+    for (const char* name : {"random-loss", "burst-loss", "shallow-buffer",
+                             "random-jitter"})
+    {
+        std::unique_ptr<HazardProfile> hazard = make_hazard (name, {}, 1);
+        bench.run (std::string (name) + "::get_effects", [&] (size_t i)
+        {
+            keep (hazard->get_effects (PacketType::Data, (id_t) i));
+        });
+    }
+
+    /**** WINDOW ****/
+    {
+        // Per packet: add, then every window's worth ack all and shift
+        Window window;
+        std::vector<AckPacket> acks;
+        acks.reserve (window.max_size ());
+        DataPacket packet = make_packet (0);
+        std::span<const byte_t> payload {packet.payload.data (),
+                                         packet.byte_count};
+
+        bench.run ("Window add/set_acks/try_shift", [&] (size_t i)
+        {
+            PacketHeader header = {.type = PacketType::Data,
+                                   .id = (id_t) i};
+            window.add (header, payload);
+            acks.push_back ({.header = header});
+
+            if (window.n == window.max_size ())
+            {
+                window.set_acks (acks);
+                keep (window.try_shift ());
+                acks.clear ();
+            }
+        });
+    }
+
+    /**** REORDER ****/
+    {
+        // Per packet: insert with every pair swapped, deliver, pop
+        ReorderBuffer reorder;
+        DataPacket packet = make_packet (0);
+
+        bench.run ("ReorderBuffer insert/deliver", [&] (size_t i)
+        {
+            packet.header.id = (id_t) (i ^ 1);
+            reorder.insert (packet, 0);
+            reorder.advance ([] (const BufferedPacket&) { return true; });
+
+            while (const BufferedPacket* ready = reorder.front ())
+            {
+                keep (ready->packet.payload ().size ());
+                reorder.pop ();
+            }
+        });
+    }
+
+    /**** LOOPBACK ****/
+    {
+        int tx = create_udp_socket ();
+        int rx = create_udp_socket ();
+        if (tx < 0 || rx < 0 || bind_socket (rx, 0) < 0)
+        {
+            std::cerr << "Could not open loopback sockets" << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        sockaddr_in dest {};
+        socklen_t dest_len = sizeof (dest);
+        getsockname (rx, (sockaddr*) &dest, &dest_len);
+        dest.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+        DataPacket out = make_packet (0);
+        DataPacket in {};
+
+        // Loopback delivers synchronously, the receive never waits
+        bench.run ("send_data/receive_data", [&] (size_t i)
+        {
+            out.header.id = (id_t) i;
+            send_data (tx, out, dest);
+            keep (receive_data (rx, in));
+        }, 20);
+
+        close (tx);
+        close (rx);
+    }
+
+    /**** SHARED MEMORY ****/
+    {
+        // Same calls over the shared memory transport. Ports only name
+        // the rings, pick ones no concurrent run uses.
+        use_shm_transport ();
+        int tx_port = 40000 + 2 * (getpid () % 10000);
+
+        int tx = create_udp_socket ();
+        int rx = create_udp_socket ();
+        if (tx < 0 || rx < 0 || bind_socket (tx, tx_port) < 0
+            || bind_socket (rx, tx_port + 1) < 0)
+        {
+            std::cerr << "Could not open shared memory endpoints"
+                      << std::endl;
+            return EXIT_FAILURE;
+        }
+
+        sockaddr_in dest = make_dest_addr ("127.0.0.1", tx_port + 1);
+        DataPacket out = make_packet (0);
+        DataPacket in {};
+
+        bench.run ("shm send_data/receive_data", [&] (size_t i)
+        {
+            out.header.id = (id_t) i;
+            send_data (tx, out, dest);
+            keep (receive_data (rx, in));
+        }, 20);
+
+        close_socket (tx);
+        close_socket (rx);
+    }
+
+    /**** DISPLAY ****/
+    {
+        Display display;
+        for (id_t id = 0; id < 10; ++id)
+            display.add_event ({.time_ns = get_time_ns (), .id = id,
+                                .type = EventType::Transmit,
+                                .stage = Stage::Sender});
+
+        std::string header = "Sender | window 10 | rate 1000 pkt/s";
+        std::string stats = "Sent: 123456 | Acked: 123400 | Resent: 56";
+
+        // Render into /dev/null rather than the terminal
+        std::fflush (stdout);
+        int saved = dup (STDOUT_FILENO);
+        int null_fd = open ("/dev/null", O_WRONLY);
+        dup2 (null_fd, STDOUT_FILENO);
+
+        bench.run ("Display::render", [&] (size_t)
+        {
+            display.render (header, stats);
+        }, 20);
+
+        std::fflush (stdout);
+        dup2 (saved, STDOUT_FILENO);
+        close (null_fd);
+        close (saved);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -3,15 +3,28 @@
  * @brief Receives packets
  */
 
-#include "network.h"
+#include "connection.h"
 #include "helpers.h"
 #include "metrics.h"
 #include "display.h"
+#include "exporter.h"
+#include "perf.h"
+#include "lowlatency.h"
+#include "trace.h"
+#include "mapped.h"
+#include "handoff.h"
+#include "multipath.h"
+#include <atomic>
+#include <chrono>
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
-#include <set>
+#include <poll.h>
 #include <string>
+#include <memory>
 #include <cstdio>
+#include <thread>
+#include <vector>
 
 /**
  * Runner
@@ -21,109 +34,279 @@ int main (int argc, char* argv[])
     /**** PARSE ARGS ****/
     if (argc < 3)
     {
-        std::cerr << "Usage: ./receiver [bind port] [ack dest port]" << std::endl;
+        std::cerr << "Usage: ./receiver [bind port] [ack dest port]"
+                     " [--output path] [--watermark packets] [--messages]"
+                     " [--ack-every n] [--ack-delay ms] [--multipath]"
+                     " [--receive-window packets]"
+                     " [--headless] [--perf] [--shm]"
+                     " [--cpus list] [--busy-poll] [--fifo priority]"
+                     " [--metrics file] [--trace file]" << std::endl;
         return EXIT_FAILURE;
     }
 
-    int bind_port = atoi (argv[1]);
-    int ack_dest_port = atoi (argv[2]);
+    ConnectionConfig config {.bind_port = atoi (argv[1]),
+                             .peer_port = atoi (argv[2])};
 
-    int sock = create_udp_socket ();
-    if (sock < 0)
+    // --ack-every / --ack-delay: coalesce acks, 1 acks every packet
+    if (const char* every = get_option (argc, argv, "--ack-every"))
+        config.ack_every = std::max (1L, atol (every));
+    if (const char* delay = get_option (argc, argv, "--ack-delay"))
+        config.ack_delay = atol (delay);
+
+    // --receive-window: packets buffered before data is refused
+    if (const char* packets = get_option (argc, argv, "--receive-window"))
+        config.receive_window = std::max (1L, atol (packets));
+
+    // --cpus, --busy-poll, --fifo: low-latency mode, set up before any
+    // helper thread starts so helpers stay off the network thread's cpu
+    auto low_latency_options = parse_low_latency (argc, argv);
+    if (!low_latency_options)
         return EXIT_FAILURE;
 
-    // Data receive
-    if (bind_socket (sock, bind_port) < 0)
+    LowLatencyMode low_latency (*low_latency_options);
+
+    // --headless: no terminal rendering, --metrics: json lines snapshots
+    bool headless = has_flag (argc, argv, "--headless");
+    MetricsExporter exporter (get_option (argc, argv, "--metrics"));
+    Tracer tracer (get_option (argc, argv, "--trace"), Stage::Receiver);
+
+    // --perf: hardware counters around hot sections, reported per packet
+    // in the metrics snapshots
+    std::unique_ptr<SectionProfiler> profiler;
+    if (has_flag (argc, argv, "--perf"))
     {
-        std::cerr << "Issue binding receiver" << std::endl;
+        profiler = std::make_unique<SectionProfiler> ();
+        if (!profiler->is_open ())
+            std::cerr << "Hardware counters unavailable, counting calls only"
+                      << std::endl;
+        exporter.set_profiler (profiler.get ());
+    }
+
+    // --output: write the transfer to a file as it is delivered
+    const char* output_path = get_option (argc, argv, "--output");
+    FileSink sink (output_path);
+    if (output_path && !sink.is_open ())
         return EXIT_FAILURE;
+
+    // --watermark: payloads handed to the writer before the network
+    // thread stops publishing and leaves them buffered
+    const char* watermark = get_option (argc, argv, "--watermark");
+    DeliveryHandoff handoff (watermark ? (size_t) atol (watermark) : 1024);
+
+    // --messages: reassemble whole messages with recv_message () and
+    // write each as it completes, on the network thread, instead of
+    // handing payloads to the writer
+    bool messages = has_flag (argc, argv, "--messages");
+
+    // --shm: shared memory rings to peers on this host instead of UDP
+    if (has_flag (argc, argv, "--shm"))
+        use_shm_transport ();
+
+    // --multipath: data arrives over several emulators, ack each path
+    // back the way its data came
+    std::unique_ptr<PacketLink> link;
+    if (has_flag (argc, argv, "--multipath"))
+    {
+        link = std::make_unique<MultipathLink> (config.bind_port,
+                                                config.peer_ip,
+                                                std::vector<int> {});
+        if (link->fd () < 0)
+            return EXIT_FAILURE;
     }
 
-    // Ack send
-    sockaddr_in ack_dest_addr = make_dest_addr ("127.0.0.1", ack_dest_port);
+    Connection conn = link ? Connection (config, std::move (link))
+                           : Connection (config);
+    if (!conn.is_open ())
+        return EXIT_FAILURE;
+
+    conn.set_profiler (profiler.get ());
+    low_latency.tune_socket (conn.fd ());
 
     /**** START RECEIVE ****/
-    std::set<DataPacket> in_buf {};
-    DataPacket data_packet {};
-    id_t last_handled_id = -1;      // intentional underflow
+    Display display {!headless};
+    conn.set_event_handler ([&] (const TraceEvent& trace_event)
+    {
+        display.add_event (trace_event);
+        tracer.record (trace_event);
+    });
 
-    ReceiverMetrics metrics {};
-    Display display {};
+    // Writer thread drains delivered payloads into the sink, so a slow
+    // disk never holds up the socket
+    std::atomic<bool> sink_ok {true};
+    auto write_payloads = [&]
+    {
+        while (!handoff.finished ())
+        {
+            auto batch = handoff.acquire ();
+            if (batch.empty ())
+            {
+                std::this_thread::sleep_for (std::chrono::milliseconds (1));
+                continue;
+            }
 
-    ms_t rate_window_start = get_time_ms ();
-    size_t rate_window_count = 0;
-    float current_rate = 0.0f;
+            for (std::span<const byte_t> payload : batch)
+                if (sink.is_open () && !sink.write (payload))
+                    sink_ok = false;
 
-    while (true)
-    {
-        // Receive data
-        if (receive_data (sock, data_packet) < 1)
-            continue;
+            handoff.release (batch.size ());
+        }
 
-        ++metrics.total_received;
-        ++rate_window_count;
-        id_t id = data_packet.header.id;
-        bool is_new = false;
+        if (!sink.finish ())
+            sink_ok = false;
+    };
 
-        if ((id > last_handled_id) || (last_handled_id == (id_t)-1))
-            is_new = in_buf.insert (data_packet).second;
+    std::thread writer;
+    if (!messages)
+        writer = std::thread (write_payloads);
 
-        if (is_new)
+    // Fragments go straight into the buffer while a message is in
+    // progress. message_size () never exceeds it then, so it only grows,
+    // and moves, between messages.
+    std::vector<byte_t> message;
+    auto deliver = [&]
+    {
+        if (!messages)
         {
-            ++metrics.unique_received;
-            metrics.bytes_received += data_packet.byte_count;
-            display.add_event ("Received  ID " + std::to_string (id));
+            handoff.pump (conn);
+            return;
         }
-        else
+
+        while (true)
         {
-            display.add_event ("Duplicate ID " + std::to_string (id));
+            ssize_t size = conn.message_size ();
+            if (size > (ssize_t) message.size ())
+                message.resize ((size_t) size);
+
+            ssize_t length = conn.recv_message (message);
+            if (length <= 0)
+                break;
+
+            if (sink.is_open ()
+                && !sink.write ({message.data (), (size_t) length}))
+                sink_ok = false;
         }
+    };
+
+    const ReceiverMetrics& metrics = conn.receiver_metrics ();
+    bool complete = false;
+
+    // Keep acking retransmitted fins until the sender goes quiet
+    constexpr ms_t linger = 1000;
+
+    ms_t rate_window_start = get_time_ms ();
+    size_t rate_window_received = 0;
+    float current_rate = 0.0f;
 
-        // Send ack
-        AckPacket ack = {.header = {.type = PacketType::Ack,
-                                    .id = data_packet.header.id}};
+    low_latency.enter ();
+    while (true)
+    {
+        exporter.tick (metrics);
 
-        if (send_ack (sock, ack, ack_dest_addr) < 0)
-            display.add_event ("Ack fail  ID " + std::to_string (id));
+        // Wait for data, waking up for delayed acks, snapshots and linger
+        ns_t timer_ns = conn.next_timer_ns () - get_time_ns ();
+        int timeout = (int) std::clamp<ns_t> ((timer_ns + 999999) / 1000000,
+                                              0, 100);
 
-        // Deliver contiguous packets
-        while (!in_buf.empty ())
+        pollfd pollfds[1] = {{.fd = conn.fd (), .events = POLLIN}};
+        int ready = low_latency.poll (pollfds, 1, timeout);
+        deliver ();
+        if (ready < 1)
         {
-            auto it = in_buf.begin ();
-            if (it->header.id != (last_handled_id + 1))
-                break;
+            conn.service ();
 
-            display.add_event ("Delivered ID " + std::to_string (it->header.id));
-            ++last_handled_id;
+            if (complete && get_time_ms () - conn.last_receive_ms () > linger)
+                break;
 
-            in_buf.erase (it);
+            continue;
         }
 
+        conn.service ();
+
+        // Hand delivered payloads to the writer without copying them out
+        deliver ();
+        complete = conn.peer_finished ();
+
         // Update rolling rate
         ms_t now = get_time_ms ();
         ms_t elapsed = now - rate_window_start;
         if (elapsed >= 1000)
         {
-            current_rate = rate_window_count / (elapsed / 1000.0f);
-            rate_window_count = 0;
+            current_rate = (metrics.total_received - rate_window_received)
+                         / (elapsed / 1000.0f);
+            rate_window_received = metrics.total_received;
             rate_window_start = now;
         }
 
-        char rate_buf[32];
-        std::snprintf (rate_buf, sizeof (rate_buf), "%.0f", current_rate);
+        // Render display
+        if (display.is_enabled ())
+        {
+            SectionScope scope (profiler.get (), Section::Display);
+            char rate_buf[32];
+            std::snprintf (rate_buf, sizeof (rate_buf), "%.0f", current_rate);
 
-        char kbps_buf[32];
-        std::snprintf (kbps_buf, sizeof (kbps_buf), "%.1f",
-                       metrics.bytes_received / 1024.0f);
+            char kbps_buf[32];
+            std::snprintf (kbps_buf, sizeof (kbps_buf), "%.1f",
+                           metrics.bytes_received / 1024.0f);
 
-        // Render display
-        std::string stats =
-            "  Rate: " + std::string (rate_buf) + " pkt/s" +
-            "  |  Received: " + std::to_string (metrics.unique_received) +
-                "/" + std::to_string (metrics.total_received) +
-            "  |  KB: " + kbps_buf +
-            "  |  Buffered: " + std::to_string (in_buf.size ());
-
-        display.render ("--- Receiver ---", stats);
+            std::string stats =
+                "  Rate: " + std::string (rate_buf) + " pkt/s" +
+                "  |  Received: " + std::to_string (metrics.unique_received) +
+                    "/" + std::to_string (metrics.total_received) +
+                "  |  KB: " + kbps_buf +
+                "  |  Buffered: " + std::to_string (metrics.buffered);
+
+            std::string transfer = !complete ? "in progress"
+                                 : conn.peer_verified () ? "verified"
+                                 : metrics.skipped > 0   ? "partial"
+                                                         : "MISMATCH";
+
+            display.render ("--- Receiver ---", stats,
+                            {"  " + metrics.one_way.summary ("One-way"),
+                             "  " + metrics.hol_wait.summary ("HOL wait"),
+                             "  " + metrics.wakeup.summary ("Wakeup"),
+                             "  Transfer: " + transfer});
+        }
     }
+
+    // Writer finishes once everything is released back to the connection
+    while (!messages && !handoff.is_closed ())
+    {
+        handoff.pump (conn);
+        std::this_thread::sleep_for (std::chrono::milliseconds (1));
+    }
+
+    if (messages)
+    {
+        deliver ();
+        if (!sink.finish ())
+            sink_ok = false;
+    }
+    else
+    {
+        writer.join ();
+        handoff.pump (conn);
+    }
+
+    if (!sink_ok)
+        std::cerr << "Issue writing output" << std::endl;
+
+    bool verified = conn.peer_verified () && sink_ok;
+    exporter.write (metrics);
+
+    // Packets the sender abandoned are missing from the checksum, so a
+    // partial transfer only has to have reached the fin
+    if (!verified && metrics.skipped > 0)
+    {
+        std::printf ("Transfer partial: %zu bytes delivered, %zu packets"
+                     " skipped\n", (std::size_t) conn.delivered_bytes (),
+                     (std::size_t) metrics.skipped);
+        return conn.peer_finished () && sink_ok ? EXIT_SUCCESS
+                                                : EXIT_FAILURE;
+    }
+
+    std::printf ("Transfer %s: %zu bytes delivered\n",
+                 verified ? "verified" : "MISMATCH",
+                 (std::size_t) conn.delivered_bytes ());
+
+    return verified ? EXIT_SUCCESS : EXIT_FAILURE;
 }
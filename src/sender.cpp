@@ -3,256 +3,292 @@
  * @brief Sends packets
  */
 
-#include "network.h"
+#include "connection.h"
 #include "helpers.h"
 #include "consts.h"
-#include "packet.h"
 #include "metrics.h"
 #include "display.h"
-#include "pacer.h"
+#include "exporter.h"
+#include "perf.h"
+#include "lowlatency.h"
+#include "trace.h"
+#include "mapped.h"
+#include "multipath.h"
+#include <algorithm>
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <unistd.h>
-#include <set>
+#include <poll.h>
 #include <string>
-#include <optional>
-#include <cstring>
+#include <memory>
+#include <vector>
 
 static constexpr size_t PAYLOAD_SIZE = 1024;
-
-struct WindowSlot
-{
-    DataPacket packet;
-    bool ack;
-    size_t transmissions;
-};
+static constexpr size_t SYNTHETIC_PACKETS = (2 << 10);
 
 /**
- * Handler for packet window
+ * Runner
  */
-class Window
+int main (int argc, char* argv[])
 {
-private:
-    static constexpr size_t max_size = 10;
-
-public:
-    // <DataPacket, ack received>
-    std::array<WindowSlot, max_size> out_buffer = {};
+    /**** PARSE ARGS ****/
+    if (argc < 3)
+    {
+        std::cerr << "Usage: ./sender [bind port] [dest port] [--paced]"
+                     " [--path dest port]... [--file path] [--headless]"
+                     " [--metrics file] [--trace file] [--perf] [--shm]"
+                     " [--lifetime ms]"
+                     " [--message-size bytes [--bundle-delay us]]"
+                     " [--cpus list] [--busy-poll] [--fifo priority]"
+                  << std::endl;
+        return EXIT_FAILURE;
+    }
 
-    // number of slots populated
-    size_t n = 0;
+    ConnectionConfig config {.bind_port = atoi (argv[1]),
+                             .peer_port = atoi (argv[2]),
+                             .payload_size = PAYLOAD_SIZE};
 
-    /**
-     * Move start of the internal buffer to out_buffer and update n
-     * Returns number of slots opened
-     */
-    size_t try_shift ()
+    // --paced: token bucket rate shaping, 75 pkt/s avg, burst cap 5
+    bool paced = has_flag (argc, argv, "--paced");
+    if (paced)
     {
-        size_t ind = 0;
-        while (ind < n && out_buffer[ind].ack)
-            ++ind;
-
-        std::move
-        (
-            out_buffer.begin () + ind,
-            out_buffer.end (),
-            out_buffer.begin ()
-        );
-
-        n -= ind;
-        return ind;
+        config.pacing_rate = 75.0;
+        config.pacing_burst = 5;
     }
 
-    /**
-     * Returns false if add unsuccessful
-     */
-    bool add (DataPacket packet)
+    // --lifetime: abandon packets still unacked this many ms after they
+    // were queued, rather than retransmit stale data
+    ms_t lifetime = 0;
+    if (const char* ms = get_option (argc, argv, "--lifetime"))
+        lifetime = std::max (0L, atol (ms));
+
+    // --message-size: send the input as messages of this many bytes,
+    // fragmented by the connection, instead of packet-sized chunks
+    size_t message_size = 0;
+    if (const char* bytes = get_option (argc, argv, "--message-size"))
+        message_size = std::max (1L, atol (bytes));
+
+    // --bundle-delay: pack small messages into shared packets, holding
+    // one at most this many microseconds for more to join it. Only
+    // messages bundle, so it needs --message-size.
+    if (const char* delay = get_option (argc, argv, "--bundle-delay"))
     {
-        if (n == max_size)
-            return false;
+        if (message_size == 0)
+        {
+            std::cerr << "--bundle-delay needs --message-size" << std::endl;
+            return EXIT_FAILURE;
+        }
 
-        out_buffer[n++] = WindowSlot {.packet = packet,
-                                      .ack = false,
-                                      .transmissions = 0};
-        return true;
+        config.bundle_delay = std::max (0L, atol (delay));
     }
 
-    /**
-     * Set packets as acknowledged
-     */
-    void set_acks (const std::set<id_t> ack_ids)
-    {
-        for (size_t ind = 0; ind < n; ++ind)
-            if (ack_ids.contains (out_buffer[ind].packet.header.id))
-                out_buffer[ind].ack = true;
-    }
+    // --cpus, --busy-poll, --fifo: low-latency mode, set up before any
+    // helper thread starts so helpers stay off the network thread's cpu
+    auto low_latency_options = parse_low_latency (argc, argv);
+    if (!low_latency_options)
+        return EXIT_FAILURE;
+
+    LowLatencyMode low_latency (*low_latency_options);
 
-    /**
-     * Count of unacked packets in window
-     */
-    size_t unacked () const
+    // --headless: no terminal rendering, --metrics: json lines snapshots
+    bool headless = has_flag (argc, argv, "--headless");
+    MetricsExporter exporter (get_option (argc, argv, "--metrics"));
+    Tracer tracer (get_option (argc, argv, "--trace"), Stage::Sender);
+
+    // --perf: hardware counters around hot sections, reported per packet
+    // in the metrics snapshots
+    std::unique_ptr<SectionProfiler> profiler;
+    if (has_flag (argc, argv, "--perf"))
     {
-        size_t count = 0;
-        for (size_t ind = 0; ind < n; ++ind)
-            if (!out_buffer[ind].ack)
-                ++count;
-        return count;
+        profiler = std::make_unique<SectionProfiler> ();
+        if (!profiler->is_open ())
+            std::cerr << "Hardware counters unavailable, counting calls only"
+                      << std::endl;
+        exporter.set_profiler (profiler.get ());
     }
-};
 
-/**
- * Runner
- */
-int main (int argc, char* argv[])
-{
-    /**** START RECEIVE ****/
-    if (argc < 3)
-    {
-        std::cerr << "Usage: ./sender [bind port] [dest port] [--paced]"
-                  << std::endl;
+    // --file: transfer a file, otherwise the synthetic payload
+    const char* input_path = get_option (argc, argv, "--file");
+    std::unique_ptr<MappedSource> source =
+        input_path ? std::make_unique<MappedSource> (input_path)
+                   : std::make_unique<MappedSource> (SYNTHETIC_PACKETS,
+                                                     PAYLOAD_SIZE);
+    if (!source->is_open ())
         return EXIT_FAILURE;
-    }
 
-    int bind_port = atoi (argv[1]);
-    int dest_port = atoi (argv[2]);
+    // --shm: shared memory rings to peers on this host instead of UDP
+    if (has_flag (argc, argv, "--shm"))
+        use_shm_transport ();
 
-    // --paced: token bucket rate shaping
-    bool paced = false;
-    for (int i = 3; i < argc; ++i)
-        if (std::string (argv[i]) == "--paced")
-            paced = true;
+    // --path: stripe across further destinations, one emulator each
+    std::vector<int> path_ports {config.peer_port};
+    for (int i = 3; i + 1 < argc; ++i)
+        if (std::strcmp (argv[i], "--path") == 0)
+            path_ports.push_back (atoi (argv[i + 1]));
 
-    // 75 pkt/s avg, burst cap 5
-    std::optional<TokenBucket> pacer;
-    if (paced)
-        pacer.emplace (75.0, 5);
+    MultipathLink* multipath = nullptr;
+    std::unique_ptr<PacketLink> link;
+    if (path_ports.size () > 1)
+    {
+        auto striped = std::make_unique<MultipathLink> (
+            config.bind_port, config.peer_ip, path_ports);
+        if (striped->fd () < 0)
+            return EXIT_FAILURE;
 
-    int sock = create_udp_socket ();
-    if (sock < 0)
-        return EXIT_FAILURE;
+        multipath = striped.get ();
+        link = std::move (striped);
+    }
 
-    // Ack receive
-    if (bind_socket (sock, bind_port) < 0)
-    {
-        std::cerr << "Issue binding sender" << std::endl;
+    Connection conn = link ? Connection (config, std::move (link))
+                           : Connection (config);
+    if (!conn.is_open ())
         return EXIT_FAILURE;
-    }
 
-    // Data send
-    sockaddr_in data_dest_addr = make_dest_addr ("127.0.0.1", dest_port);
+    conn.set_profiler (profiler.get ());
+    low_latency.tune_socket (conn.fd ());
 
     /**** START SEND ****/
-    DataPacket data_packet;
-    AckPacket ack_packet;
+    size_t chunk_size = message_size > 0 ? message_size : PAYLOAD_SIZE;
+    size_t chunk_count = source->chunk_count (chunk_size);
+    size_t next_chunk = 0;
+    bool fin_queued = false;
 
-    Window window {};
-    bool complete = false;
-    id_t last_id = -1;      // intentional underflow
+    Display display {!headless};
+    conn.set_event_handler ([&] (const TraceEvent& trace_event)
+    {
+        display.add_event (trace_event);
+        tracer.record (trace_event);
+    });
 
-    SenderMetrics metrics {};
-    Display display {};
+    const SenderMetrics& metrics = conn.sender_metrics ();
+    ms_t start_ms = get_time_ms ();
 
     // Rate tracking (1-second rolling window)
     ms_t rate_window_start = get_time_ms ();
-    size_t rate_window_count = 0;
+    size_t rate_window_sent = 0;
     float current_rate = 0.0f;
     size_t last_burst = 0;
 
-    while (!complete)
-    {
-        // receive all acks, set in window
-        std::set<id_t> ack_ids = receive_all_acks (sock, ack_timeout);
-        window.set_acks (ack_ids);
+    low_latency.enter ();
+    pollfd pollfds[1] = {{.fd = conn.fd (), .events = POLLIN}};
 
-        for (id_t ack_id : ack_ids)
-            display.add_event ("Acked      ID " + std::to_string (ack_id));
+    while (!(fin_queued && conn.flushed ()))
+    {
+        // process acks, retransmit anything overdue. A pending bundle is
+        // due by its deadline, so with room to send it wait no longer;
+        // under a millisecond left this spins.
+        int timeout = (int) ack_timeout;
+        if (conn.bundle_pending () && conn.writable ())
+            timeout = (int) std::clamp<ns_t> (
+                (conn.next_timer_ns () - get_time_ns ()) / 1000000, 0,
+                timeout);
+        low_latency.poll (pollfds, 1, timeout);
+
+        size_t sent_before = metrics.total_sent;
+        conn.service ();
+
+        // fill window straight from the mapping — so burst = full window
+        while (next_chunk < chunk_count && message_size == 0
+               && conn.send_ref (source->chunk (next_chunk, PAYLOAD_SIZE),
+                                 lifetime) >= 0)
+            ++next_chunk;
+
+        // or start the next message once the last is all in the window
+        while (next_chunk < chunk_count && message_size > 0
+               && conn.send_message (source->chunk (next_chunk, message_size),
+                                     lifetime) >= 0)
+            ++next_chunk;
+
+        if (next_chunk == chunk_count && !fin_queued)
+            fin_queued = conn.finish ();
+
+        size_t burst = metrics.total_sent - sent_before;
+        if (burst > 0)
+            last_burst = burst;
 
-        // shift window
-        window.try_shift ();
+        exporter.tick (metrics);
 
-        // fill window, then send — so burst = full window
-        for (id_t id = last_id + 1; id < (2 << 10); ++id)
+        // Update rolling rate (1-second window)
+        ms_t now = get_time_ms ();
+        ms_t elapsed = now - rate_window_start;
+        if (elapsed >= 1000)
         {
-            data_packet.header = {.type = PacketType::Data, .id = id};
-            data_packet.byte_count = PAYLOAD_SIZE;
-            memset (data_packet.payload.data (), (byte_t) (id & 0xFF),
-                    PAYLOAD_SIZE);
-
-            if (!window.add (data_packet))
-                break;
-
-            last_id = id;
+            current_rate = (metrics.total_sent - rate_window_sent)
+                         / (elapsed / 1000.0f);
+            rate_window_sent = metrics.total_sent;
+            rate_window_start = now;
         }
 
-        // send all unacked in window
-        size_t burst = 0;
-        for (size_t ind = 0; ind < window.n; ++ind)
+        // Render display
+        if (display.is_enabled ())
         {
-            if (window.out_buffer[ind].ack)
-                continue;
-
-            // Rate shaping: skip if bucket empty
-            if (pacer && !pacer->try_consume ())
-                break;
-
-            id_t id = window.out_buffer[ind].packet.header.id;
-            bool is_retransmit = window.out_buffer[ind].transmissions > 0;
-
-            if (send_data (sock, window.out_buffer[ind].packet,
-                           data_dest_addr) < 0)
+            SectionScope scope (profiler.get (), Section::Display);
+            char rate_buf[32];
+            std::snprintf (rate_buf, sizeof (rate_buf), "%.0f", current_rate);
+
+            char eff_buf[32];
+            float efficiency = metrics.total_sent > 0
+                ? (100.0f * metrics.unique_sent / metrics.total_sent) : 100.0f;
+            std::snprintf (eff_buf, sizeof (eff_buf), "%.0f%%", efficiency);
+
+            std::string mode = paced ? "Paced" : "Unshaped";
+            std::string stats =
+                "  [" + mode + "]" +
+                "  Burst: " + std::to_string (last_burst) +
+                "  |  Rate: " + rate_buf + " pkt/s" +
+                "  |  Efficiency: " + eff_buf +
+                "  |  Sent: " + std::to_string (metrics.unique_sent) +
+                    "/" + std::to_string (metrics.total_sent) +
+                "  |  In Flight: " + std::to_string (metrics.in_flight) +
+                    "/" + std::to_string (conn.congestion_window ());
+
+            std::vector<std::string> details {
+                "  " + metrics.rtt.summary ("RTT"),
+                "  " + metrics.wakeup.summary ("Wakeup")};
+            for (size_t ind = 0; multipath
+                 && ind < multipath->path_stats ().size (); ++ind)
             {
-                display.add_event ("Send fail  ID " + std::to_string (id));
-                continue;
+                const PathStats& path = multipath->path_stats ()[ind];
+                char path_buf[128];
+                std::snprintf (path_buf, sizeof (path_buf),
+                               "  Path %d: sent %zu  lost %zu  srtt %.1f ms"
+                               "  loss %.0f%%", path_ports[ind],
+                               (std::size_t) path.sent,
+                               (std::size_t) path.lost, path.srtt_ms,
+                               100.0 * path.loss);
+                details.push_back (path_buf);
             }
 
-            if (is_retransmit)
-                display.add_event ("Retransmit ID " + std::to_string (id));
-            else
-                display.add_event ("Transmit   ID " + std::to_string (id));
-
-            if (!is_retransmit)
-                ++metrics.unique_sent;
-
-            ++window.out_buffer[ind].transmissions;
-            ++metrics.total_sent;
-            metrics.bytes_sent += window.out_buffer[ind].packet.byte_count;
-            ++burst;
-            ++rate_window_count;
+            display.render ("--- Sender ---", stats, details);
         }
-        if (burst > 0)
-            last_burst = burst;
 
-        // Update rolling rate (1-second window)
-        ms_t now = get_time_ms ();
-        ms_t elapsed = now - rate_window_start;
-        if (elapsed >= 1000)
+        // Between bursts: sleep, or keep taking acks when busy polling.
+        // Not with a bundle pending, the poll above keeps its deadline.
+        if (conn.bundle_pending ())
+            continue;
+
+        if (!low_latency.busy_polling ())
         {
-            current_rate = rate_window_count / (elapsed / 1000.0f);
-            rate_window_count = 0;
-            rate_window_start = now;
+            usleep (sec_to_us ({sec_t {0.1}}));
+            continue;
         }
 
-        // Render display
-        char rate_buf[32];
-        std::snprintf (rate_buf, sizeof (rate_buf), "%.0f", current_rate);
-
-        char eff_buf[32];
-        float efficiency = metrics.total_sent > 0
-            ? (100.0f * metrics.unique_sent / metrics.total_sent) : 100.0f;
-        std::snprintf (eff_buf, sizeof (eff_buf), "%.0f%%", efficiency);
-
-        std::string mode = paced ? "Paced" : "Unshaped";
-        std::string stats =
-            "  [" + mode + "]" +
-            "  Burst: " + std::to_string (last_burst) +
-            "  |  Rate: " + rate_buf + " pkt/s" +
-            "  |  Efficiency: " + eff_buf +
-            "  |  Sent: " + std::to_string (metrics.unique_sent) +
-                "/" + std::to_string (metrics.total_sent) +
-            "  |  In Flight: " + std::to_string (window.unacked ()) + "/10";
-
-        display.render ("--- Sender ---", stats);
-
-        usleep (sec_to_us ({sec_t {0.1}}));
+        for (ns_t until_ns = get_time_ns () + 100000000;
+             get_time_ns () < until_ns;)
+            if (low_latency.poll (pollfds, 1, 0) > 0)
+                conn.service ();
     }
+
+    exporter.write (metrics);
+
+    double elapsed_sec = (get_time_ms () - start_ms) / 1000.0;
+    std::printf ("Transfer complete: %zu bytes in %.1f s (%zu packets sent)\n",
+                 (std::size_t) source->size (), elapsed_sec,
+                 (std::size_t) metrics.total_sent);
+    if (metrics.abandoned > 0)
+        std::printf ("%zu packets abandoned past their lifetime\n",
+                     (std::size_t) metrics.abandoned);
+
+    return EXIT_SUCCESS;
 }
@@ -0,0 +1,338 @@
+/**
+ * @file simulation.cpp
+ * @brief Discrete-event simulation of a transfer in virtual time
+ */
+
+#include "simulation.h"
+#include "connection.h"
+#include "buffer.h"
+#include "hazards.h"
+#include "helpers.h"
+#include "ring.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+namespace
+{
+
+/**
+ * Packet travelling between the endpoints, stored at its wire size
+ */
+struct InFlight
+{
+    ns_t arrive_ns;
+    uint64_t seq;               // tie-break keeps equal times in send order
+    PacketRef packet;
+};
+
+/**
+ * Min-heap of packets on one direction of the path, by arrival
+ */
+class InFlightQueue
+{
+private:
+    std::vector<InFlight> heap {};
+
+    static bool later (const InFlight& lhs, const InFlight& rhs)
+    {
+        if (lhs.arrive_ns == rhs.arrive_ns)
+            return lhs.seq > rhs.seq;
+
+        return lhs.arrive_ns > rhs.arrive_ns;
+    }
+
+public:
+    bool empty () const { return heap.empty (); }
+    const InFlight& top () const { return heap.front (); }
+
+    void push (InFlight flight)
+    {
+        heap.push_back (std::move (flight));
+        std::push_heap (heap.begin (), heap.end (), later);
+    }
+
+    InFlight pop ()
+    {
+        std::pop_heap (heap.begin (), heap.end (), later);
+        InFlight flight = std::move (heap.back ());
+        heap.pop_back ();
+        return flight;
+    }
+};
+
+/**
+ * Both directions of the emulated path, with the hazard chain.
+ * Packets are stored once, sized to their wire length, from send until
+ * the receiving end is done with them, so the queues and the endpoints
+ * only move small handles around.
+ */
+class SimNetwork
+{
+private:
+    std::vector<std::unique_ptr<HazardProfile>> hazards;
+    ns_t propagation_ns;
+    uint64_t seq = 0;
+
+public:
+    PacketPool pool {};
+    InFlightQueue to_receiver {};
+    InFlightQueue to_sender {};
+    size_t dropped = 0;
+
+    SimNetwork (const SimConfig& config) : propagation_ns (config.propagation
+                                                           * 1000000)
+    {
+        // Distinct, reproducible seed per hazard
+        unsigned int seed = config.seed;
+        for (const HazardSpec& spec : config.hazards)
+        {
+            auto hazard = make_hazard (spec.name, spec.params, seed++);
+            if (hazard)
+                hazards.push_back (std::move (hazard));
+            else
+                std::cerr << "Unknown hazard: " << spec.name << std::endl;
+        }
+    }
+
+    /**
+     * Put a stored packet on the path, through the hazards
+     */
+    void transmit (PacketRef packet, bool forward)
+    {
+        PacketHeader header = packet.header ();
+
+        ns_t delay_ns = 0;
+        bool drop = false;
+        for (auto& hazard : hazards)
+        {
+            Effects effects = hazard->get_effects (header.type, header.id);
+            drop |= effects.drop;
+            delay_ns += effects.delay_ns;
+        }
+
+        if (drop)
+        {
+            ++dropped;
+            return;
+        }
+
+        ns_t arrive_ns = get_time_ns () + propagation_ns + delay_ns;
+        (forward ? to_receiver : to_sender).push ({arrive_ns, seq++,
+                                                   std::move (packet)});
+    }
+
+    /**
+     * Earliest arrival in either direction, or limit if none
+     */
+    ns_t next_arrival (ns_t limit) const
+    {
+        if (!to_receiver.empty ())
+            limit = std::min (limit, to_receiver.top ().arrive_ns);
+        if (!to_sender.empty ())
+            limit = std::min (limit, to_sender.top ().arrive_ns);
+
+        return limit;
+    }
+};
+
+/**
+ * One endpoint's view of the SimNetwork
+ */
+class SimLink : public PacketLink
+{
+private:
+    SimNetwork& network;
+    bool forward;
+
+public:
+    RingDeque<PacketRef> inbox {};
+
+    SimLink (SimNetwork& network, bool forward)
+        : network (network), forward (forward) {}
+
+    ssize_t send_data (const PacketHeader& header,
+                       std::span<const byte_t> payload) override
+    {
+        // Header and used payload only, as a datagram would carry
+        PacketRef packet = network.pool.store (header, payload);
+        ssize_t len = (ssize_t) packet.size ();
+        network.transmit (std::move (packet), forward);
+        return len;
+    }
+
+    ssize_t send_ack (const AckPacket& ack) override
+    {
+        network.transmit (network.pool.store (ack), forward);
+        return (ssize_t) sizeof (AckPacket);
+    }
+
+    ssize_t receive (UnionPacket& packet, ns_t& arrival_ns) override
+    {
+        PacketRef ref;
+        if (!receive_ref (ref, arrival_ns))
+            return -1;
+
+        // Copy only the bytes a datagram would have carried
+        memcpy (&packet, ref.bytes ().data (), ref.size ());
+        return (ssize_t) ref.size ();
+    }
+
+    bool pooled () const override { return true; }
+
+    /**
+     * Hand the stored packet itself to the endpoint, so it is written
+     * once on send and never copied on its way through
+     */
+    bool receive_ref (PacketRef& packet, ns_t& arrival_ns) override
+    {
+        if (inbox.empty ())
+            return false;
+
+        arrival_ns = get_time_ns ();
+        packet = std::move (inbox.front ());
+        inbox.pop_front ();
+        return true;
+    }
+};
+
+/**
+ * Move arrivals due by now into an inbox. Returns true if any arrived.
+ */
+bool deliver_due (InFlightQueue& queue, SimLink& link, ns_t now)
+{
+    bool arrived = false;
+    while (!queue.empty () && queue.top ().arrive_ns <= now)
+    {
+        link.inbox.push_back (queue.pop ().packet);
+        arrived = true;
+    }
+
+    return arrived;
+}
+
+/**
+ * Switches the calling thread to virtual time for its lifetime
+ */
+struct VirtualClockScope
+{
+    VirtualClockScope ()
+    {
+        VirtualClock::now_ns = 0;
+        VirtualClock::enabled = true;
+    }
+
+    ~VirtualClockScope () { VirtualClock::enabled = false; }
+};
+
+}   // namespace
+
+SimResult run_simulation (const SimConfig& config)
+{
+    auto wall_start = std::chrono::steady_clock::now ();
+    VirtualClockScope clock_scope;
+
+    SimNetwork network (config);
+
+    auto sender_link = std::make_unique<SimLink> (network, true);
+    auto receiver_link = std::make_unique<SimLink> (network, false);
+    SimLink& to_sender = *sender_link;
+    SimLink& to_receiver = *receiver_link;
+
+    ConnectionConfig sender_config {.payload_size = config.payload_size,
+                                    .pacing_rate = config.pacing_rate,
+                                    .pacing_burst = config.pacing_burst,
+                                    .retransmit_timeout =
+                                        config.retransmit_timeout,
+                                    .window_size = config.window_size,
+                                    .initial_sequence =
+                                        config.initial_sequence};
+    ConnectionConfig receiver_config {.ack_every = config.ack_every,
+                                      .ack_delay = config.ack_delay,
+                                      .initial_sequence =
+                                          config.initial_sequence};
+
+    Connection sender (sender_config, std::move (sender_link));
+    Connection receiver (receiver_config, std::move (receiver_link));
+
+    // Content is irrelevant here, every packet references one chunk
+    std::vector<byte_t> chunk (config.payload_size, 0xA5);
+    size_t next_chunk = 0;
+    bool fin_queued = false;
+
+    // Sender loop state: polling for acks until poll_end, else asleep
+    // until wake_ns
+    ns_t ack_wait_ns = config.ack_wait * 1000000;
+    ns_t tick_ns = config.tick * 1000000;
+    ns_t limit_ns = config.time_limit * 1000000;
+    bool polling = true;
+    ns_t poll_end = ack_wait_ns;
+    ns_t wake_ns = 0;
+
+    SimResult result {};
+    while (true)
+    {
+        ns_t sender_event = polling ? poll_end : wake_ns;
+        ns_t receiver_timer = receiver.next_timer_ns ();
+        ns_t now = network.next_arrival (std::min (sender_event,
+                                                   receiver_timer));
+        if (now > limit_ns)
+            break;
+
+        VirtualClock::now_ns = now;
+
+        // Receiver wakes on every arrival and on its ack timer
+        if (deliver_due (network.to_receiver, to_receiver, now)
+            || now >= receiver_timer)
+        {
+            receiver.service ();
+            while (!receiver.peek ().empty ())
+                receiver.consume ();
+        }
+
+        bool acks_arrived = deliver_due (network.to_sender, to_sender, now);
+
+        // Sleep over, start polling for acks
+        if (!polling && now >= wake_ns)
+        {
+            polling = true;
+            poll_end = now + ack_wait_ns;
+        }
+
+        // Poll returns on acks or timeout, then one sender loop iteration
+        if (polling && (acks_arrived || !to_sender.inbox.empty ()
+                        || now >= poll_end))
+        {
+            sender.service ();
+
+            while (next_chunk < config.packets
+                   && sender.send_ref (chunk) >= 0)
+                ++next_chunk;
+
+            if (next_chunk == config.packets && !fin_queued)
+                fin_queued = sender.finish ();
+
+            polling = false;
+            wake_ns = now + tick_ns;
+        }
+
+        if (fin_queued && sender.flushed () && receiver.peer_finished ())
+        {
+            result.completed = true;
+            break;
+        }
+    }
+
+    result.verified = result.completed && receiver.peer_verified ();
+    result.sim_ns = VirtualClock::now_ns;
+    result.dropped = network.dropped;
+    result.sender = sender.sender_metrics ();
+    result.receiver = receiver.receiver_metrics ();
+    result.wall_sec = std::chrono::duration<double> (
+        std::chrono::steady_clock::now () - wall_start).count ();
+
+    return result;
+}
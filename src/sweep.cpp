@@ -0,0 +1,277 @@
+/**
+ * @file sweep.cpp
+ * @brief Runs a grid of simulated transfers in parallel and tabulates them
+ */
+
+#include "simulation.h"
+#include "metrics.h"
+#include "helpers.h"
+#include "pool.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Comma separated numbers
+ */
+static std::vector<double> parse_list (const std::string& text)
+{
+    std::vector<double> values;
+    for (size_t pos = 0; pos != std::string::npos; )
+    {
+        values.push_back (atof (text.c_str () + pos));
+        pos = text.find (',', pos);
+        if (pos != std::string::npos)
+            ++pos;
+    }
+
+    return values;
+}
+
+/**
+ * Every hazard a spec like "burst-loss:0.01/0.05,0.005" stands for:
+ * comma separated constructor arguments, slash separated alternatives
+ */
+static std::vector<HazardSpec> expand_hazard (const std::string& arg)
+{
+    size_t colon = arg.find (':');
+    std::vector<HazardSpec> specs {{.name = arg.substr (0, colon)}};
+    if (colon == std::string::npos)
+        return specs;
+
+    std::string params = arg.substr (colon + 1);
+    for (size_t pos = 0; pos != std::string::npos; )
+    {
+        size_t end = params.find (',', pos);
+        std::string param = params.substr (pos, end == std::string::npos
+                                                ? end : end - pos);
+        pos = end == std::string::npos ? end : end + 1;
+
+        std::vector<double> choices;
+        for (size_t at = 0; at != std::string::npos; )
+        {
+            choices.push_back (atof (param.c_str () + at));
+            at = param.find ('/', at);
+            if (at != std::string::npos)
+                ++at;
+        }
+
+        std::vector<HazardSpec> next;
+        for (const HazardSpec& spec : specs)
+        {
+            for (double choice : choices)
+            {
+                HazardSpec expanded = spec;
+                expanded.params.push_back (choice);
+                next.push_back (expanded);
+            }
+        }
+
+        specs = std::move (next);
+    }
+
+    return specs;
+}
+
+/**
+ * Short name of a hazard chain, e.g. "random-loss:0.05+random-jitter"
+ */
+static std::string chain_label (const std::vector<HazardSpec>& chain)
+{
+    if (chain.empty ())
+        return "none";
+
+    std::string label;
+    for (const HazardSpec& spec : chain)
+    {
+        if (!label.empty ())
+            label += "+";
+
+        label += spec.name;
+        for (size_t ind = 0; ind < spec.params.size (); ++ind)
+        {
+            char buf[32];
+            std::snprintf (buf, sizeof (buf), "%s%g", ind == 0 ? ":" : ",",
+                           spec.params[ind]);
+            label += buf;
+        }
+    }
+
+    return label;
+}
+
+/**
+ * One grid point, aggregated over its seeds
+ */
+struct SweepPoint
+{
+    SimConfig config;
+    std::vector<SimResult> runs;
+};
+
+/**
+ * Runner
+ */
+int main (int argc, char* argv[])
+{
+    /**** PARSE ARGS ****/
+    if (has_flag (argc, argv, "--help"))
+    {
+        std::cerr << "Usage: ./sweep [--rate r,...] [--burst b,...]"
+                     " [--window w,...] [--hazard name:a/b,c]..."
+                     " [--packets n] [--seeds n] [--jobs n] [--csv]"
+                  << std::endl;
+        std::cerr << "A rate of 0 is unshaped. Slash separated hazard"
+                     " arguments are swept, repeated --hazard flags"
+                     " chain." << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    auto list_option = [&] (const char* name, const char* fallback)
+    {
+        const char* value = get_option (argc, argv, name);
+        return parse_list (value ? value : fallback);
+    };
+
+    std::vector<double> rates = list_option ("--rate", "0");
+    std::vector<double> bursts = list_option ("--burst", "5");
+    std::vector<double> windows = list_option ("--window", "10");
+
+    // Cross every --hazard's alternatives into whole chains
+    std::vector<std::vector<HazardSpec>> chains {{}};
+    for (int i = 1; i + 1 < argc; ++i)
+    {
+        if (std::strcmp (argv[i], "--hazard") != 0)
+            continue;
+
+        std::vector<std::vector<HazardSpec>> next;
+        for (const auto& chain : chains)
+        {
+            for (const HazardSpec& spec : expand_hazard (argv[i + 1]))
+            {
+                next.push_back (chain);
+                next.back ().push_back (spec);
+            }
+        }
+
+        chains = std::move (next);
+    }
+
+    SimConfig base {};
+    if (const char* packets = get_option (argc, argv, "--packets"))
+        base.packets = (size_t) atoll (packets);
+
+    const char* seeds_option = get_option (argc, argv, "--seeds");
+    size_t seeds = std::max (1L, seeds_option ? atol (seeds_option) : 1L);
+
+    const char* jobs_option = get_option (argc, argv, "--jobs");
+    size_t jobs = jobs_option ? (size_t) atol (jobs_option) : 0;
+
+    bool csv = has_flag (argc, argv, "--csv");
+
+    /**** BUILD GRID ****/
+    std::vector<SweepPoint> points;
+    for (double rate : rates)
+        for (double burst : bursts)
+            for (double window : windows)
+                for (const auto& chain : chains)
+                {
+                    SweepPoint point {.config = base};
+                    if (rate > 0)
+                        point.config.pacing_rate = rate;
+                    point.config.pacing_burst = burst;
+                    point.config.window_size = (size_t) window;
+                    point.config.hazards = chain;
+                    point.runs.resize (seeds);
+                    points.push_back (std::move (point));
+                }
+
+    /**** RUN ****/
+    // Every run writes only its own slot, so results need no locking
+    auto wall_start = std::chrono::steady_clock::now ();
+    {
+        WorkStealingPool pool (jobs);
+        std::cerr << "Running " << points.size () * seeds << " simulations on "
+                  << pool.size () << " threads" << std::endl;
+
+        for (SweepPoint& point : points)
+        {
+            for (size_t seed = 0; seed < seeds; ++seed)
+            {
+                pool.submit ([&point, seed]
+                {
+                    SimConfig config = point.config;
+                    config.seed = (unsigned int) seed;
+                    point.runs[seed] = run_simulation (config);
+                });
+            }
+        }
+
+        pool.wait ();
+    }
+    double wall_sec = std::chrono::duration<double> (
+        std::chrono::steady_clock::now () - wall_start).count ();
+
+    /**** REPORT ****/
+    if (csv)
+        std::printf ("rate,burst,window,hazards,runs,verified,mean_sim_s,"
+                     "efficiency,rtt_p50_ms,rtt_p99_ms,hol_p99_ms\n");
+    else
+        std::printf ("%6s %5s %6s  %-36s %8s %10s %6s %9s %9s %9s\n",
+                     "rate", "burst", "window", "hazards", "verified",
+                     "sim s", "eff %", "rtt p50", "rtt p99", "hol p99");
+
+    for (const SweepPoint& point : points)
+    {
+        size_t verified = 0;
+        double sim_sec = 0.0;
+        size_t total_sent = 0;
+        size_t unique_sent = 0;
+        LatencyHistogram rtt;
+        LatencyHistogram hol_wait;
+
+        for (const SimResult& run : point.runs)
+        {
+            verified += run.verified;
+            sim_sec += run.sim_ns / 1e9;
+            total_sent += run.sender.total_sent;
+            unique_sent += run.sender.unique_sent;
+            rtt.merge (run.sender.rtt);
+            hol_wait.merge (run.receiver.hol_wait);
+        }
+
+        const SimConfig& config = point.config;
+        double rate = config.pacing_rate.value_or (0.0);
+        double efficiency = total_sent > 0
+            ? 100.0 * unique_sent / total_sent : 100.0;
+        std::string hazards = chain_label (config.hazards);
+        std::string runs = std::to_string (verified) + "/"
+                         + std::to_string (point.runs.size ());
+
+        if (csv)
+            std::printf ("%g,%g,%zu,\"%s\",%zu,%zu,%.3f,%.1f,%.2f,%.2f,"
+                         "%.2f\n", rate, config.pacing_burst,
+                         (std::size_t) config.window_size, hazards.c_str (),
+                         point.runs.size (), (std::size_t) verified,
+                         sim_sec / point.runs.size (), efficiency,
+                         rtt.percentile (50.0) / 1e6,
+                         rtt.percentile (99.0) / 1e6,
+                         hol_wait.percentile (99.0) / 1e6);
+        else
+            std::printf ("%6g %5g %6zu  %-36s %8s %10.2f %6.1f %9.2f %9.2f"
+                         " %9.2f\n", rate, config.pacing_burst,
+                         (std::size_t) config.window_size, hazards.c_str (),
+                         runs.c_str (), sim_sec / point.runs.size (),
+                         efficiency, rtt.percentile (50.0) / 1e6,
+                         rtt.percentile (99.0) / 1e6,
+                         hol_wait.percentile (99.0) / 1e6);
+    }
+
+    std::fprintf (stderr, "Done in %.2f s\n", wall_sec);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,92 @@
+/**
+ * @file tracedump.cpp
+ * @brief Decodes binary trace files to text or CSV
+ */
+
+#include "trace.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+ * Append all records of a trace file, returns false on a bad file
+ */
+bool read_trace (const char* path, std::vector<TraceEvent>& events)
+{
+    FILE* file = std::fopen (path, "rb");
+    if (file == nullptr)
+    {
+        std::cerr << "Could not open " << path << std::endl;
+        return false;
+    }
+
+    TraceFileHeader header {};
+    if (std::fread (&header, sizeof (header), 1, file) != 1
+        || std::memcmp (header.magic, TRACE_MAGIC, sizeof (TRACE_MAGIC)) != 0
+        || header.version != TRACE_VERSION
+        || header.record_size != sizeof (TraceEvent))
+    {
+        std::cerr << "Not a pacer trace: " << path << std::endl;
+        std::fclose (file);
+        return false;
+    }
+
+    TraceEvent event {};
+    while (std::fread (&event, sizeof (event), 1, file) == 1)
+        events.push_back (event);
+
+    std::fclose (file);
+    return true;
+}
+
+/**
+ * Runner
+ */
+int main (int argc, char* argv[])
+{
+    /**** PARSE ARGS ****/
+    if (argc < 2)
+    {
+        std::cerr << "Usage: ./tracedump [trace file]... [--csv]" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    bool csv = has_flag (argc, argv, "--csv");
+
+    // Merge every stage's trace into one timeline
+    std::vector<TraceEvent> events;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strcmp (argv[i], "--csv") == 0)
+            continue;
+
+        if (!read_trace (argv[i], events))
+            return EXIT_FAILURE;
+    }
+
+    std::stable_sort (events.begin (), events.end (),
+                      [] (const TraceEvent& a, const TraceEvent& b)
+                      { return a.time_ns < b.time_ns; });
+
+    /**** PRINT ****/
+    if (csv)
+        std::printf ("time_ns,stage,event,id,arg\n");
+
+    for (const TraceEvent& event : events)
+    {
+        if (csv)
+            std::printf ("%lld,%s,%s,%u,%u\n", (long long) event.time_ns,
+                         stage_name (event.stage), event_name (event.type),
+                         (unsigned) event.id, event.arg);
+        else
+            std::printf ("%lld  %-8s  %s\n", (long long) event.time_ns,
+                         stage_name (event.stage),
+                         format_event (event).c_str ());
+    }
+
+    return EXIT_SUCCESS;
+}